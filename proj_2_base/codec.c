@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "codec.h"
+#include "common.h"
+
+#define MIN_MATCH     4   /* The shortest match the LZ4 block format can encode */
+#define LAST_LITERALS 5   /* The last bytes of a block are always literals */
+#define MF_LIMIT      12  /* A match may not start within this many bytes of the end */
+#define HASH_LOG      14
+#define MAX_OFFSET    65535
+
+
+static uint32_t read32(const char * p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int hash32(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static char * write_length(char * op, int len)
+{
+    while (len >= 255) {
+        *op++ = (char)255;
+        len -= 255;
+    }
+    *op++ = (char)len;
+    return op;
+}
+
+static int elapsed_us(struct timeval * start)
+{
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    return (end.tv_sec - start->tv_sec) * US_PER_SEC + (end.tv_usec - start->tv_usec);
+}
+
+/* The worst-case compressed size of raw_size bytes of input */
+int codec_compress_bound(int raw_size)
+{
+    return raw_size + raw_size / 255 + 16;
+}
+
+/* Compress one block into the LZ4 block format.
+   @param src: The data to compress.
+   @param src_size: The size of the data.
+   @param dst: The output buffer.
+   @param dst_capacity: The size of the output buffer; codec_compress_bound(src_size) always suffices.
+   @ret: The compressed size, or -1 if the output does not fit in dst.
+ */
+int codec_compress_block(const char * src, int src_size, char * dst, int dst_capacity)
+{
+    int table[1 << HASH_LOG];
+    const char * ip = src;
+    const char * anchor = src;
+    const char * iend = src + src_size;
+    const char * mflimit = iend - MF_LIMIT;
+    const char * matchlimit = iend - LAST_LITERALS;
+    char * op = dst;
+    char * oend = dst + dst_capacity;
+    int misses = 0;
+
+    memset(table, 0xff, sizeof(table));
+
+    if (src_size > MF_LIMIT) {
+        while (ip < mflimit) {
+            uint32_t seq = read32(ip);
+            int h = hash32(seq);
+            int ref = table[h];
+            table[h] = ip - src;
+
+            if (ref < 0 || (ip - src) - ref > MAX_OFFSET || read32(src + ref) != seq) {
+                /* Skip faster through data that does not compress */
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            const char * match = src + ref;
+            while (ip > anchor && match > src && ip[-1] == match[-1]) {
+                ip--;
+                match--;
+            }
+
+            const char * p = ip + MIN_MATCH;
+            const char * m = match + MIN_MATCH;
+            while (p < matchlimit && *p == *m) {
+                p++;
+                m++;
+            }
+
+            int lit_len = ip - anchor;
+            int match_len = p - ip - MIN_MATCH;
+            int offset = ip - match;
+
+            if (oend - op < 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1) {
+                return -1;
+            }
+
+            char * token = op++;
+            if (lit_len >= 15) {
+                *token = (char)(15 << 4);
+                op = write_length(op, lit_len - 15);
+            } else {
+                *token = (char)(lit_len << 4);
+            }
+            memcpy(op, anchor, lit_len);
+            op += lit_len;
+
+            *op++ = (char)(offset & 0xff);
+            *op++ = (char)(offset >> 8);
+
+            if (match_len >= 15) {
+                *token |= 15;
+                op = write_length(op, match_len - 15);
+            } else {
+                *token |= match_len;
+            }
+
+            ip = p;
+            anchor = p;
+        }
+    }
+
+    int lit_len = iend - anchor;
+    if (oend - op < 1 + lit_len / 255 + 1 + lit_len) {
+        return -1;
+    }
+    if (lit_len >= 15) {
+        *op++ = (char)(15 << 4);
+        op = write_length(op, lit_len - 15);
+    } else {
+        *op++ = (char)(lit_len << 4);
+    }
+    memcpy(op, anchor, lit_len);
+    op += lit_len;
+
+    return op - dst;
+}
+
+/* Decompress one block in the LZ4 block format.
+   @param src: The compressed data.
+   @param src_size: The size of the compressed data.
+   @param dst: The output buffer.
+   @param dst_capacity: The size of the output buffer.
+   @ret: The decompressed size, or -1 if the data is corrupt or does not fit in dst.
+ */
+int codec_decompress_block(const char * src, int src_size, char * dst, int dst_capacity)
+{
+    const unsigned char * ip = (const unsigned char *)src;
+    const unsigned char * iend = ip + src_size;
+    char * op = dst;
+    char * oend = dst + dst_capacity;
+
+    while (ip < iend) {
+        unsigned int token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15) {
+            unsigned int b;
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                b = *ip++;
+                lit_len += b;
+            } while (b == 255);
+        }
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op)) {
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+
+        if (ip == iend) {
+            break; /* The last sequence has no match */
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) {
+            return -1;
+        }
+
+        size_t match_len = token & 15;
+        if (match_len == 15) {
+            unsigned int b;
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += MIN_MATCH;
+        if (match_len > (size_t)(oend - op)) {
+            return -1;
+        }
+
+        /* Byte by byte, since the match may overlap the bytes being written */
+        const char * m = op - offset;
+        while (match_len--) {
+            *op++ = *m++;
+        }
+    }
+
+    return op - dst;
+}
+
+/* Compress everything read from fd_in into blocks written to fd_out */
+static int compress_stream(int fd_in, int fd_out, CODEC_STATS * stats)
+{
+    char * raw = malloc(CODEC_BLOCK_SIZE);
+    char * packed = malloc(codec_compress_bound(CODEC_BLOCK_SIZE));
+    if (!raw || !packed) {
+        free(raw);
+        free(packed);
+        return -1;
+    }
+
+    int ret = 0;
+    ssize_t n;
+    while ((n = read_full(fd_in, raw, CODEC_BLOCK_SIZE)) > 0) {
+        struct timeval start;
+        gettimeofday(&start, NULL);
+        int packed_size = codec_compress_block(raw, n, packed, codec_compress_bound(CODEC_BLOCK_SIZE));
+        stats->codec_time += elapsed_us(&start);
+
+        CODEC_BLOCK_HEADER header = { .raw_size = n, .stored_size = n };
+        const char * body = raw;
+        if (packed_size >= 0 && packed_size < n) {
+            header.stored_size = packed_size;
+            body = packed;
+        }
+
+        if (write_full(fd_out, (char *)&header, sizeof(header)) < 0 ||
+            write_full(fd_out, body, header.stored_size) < 0) {
+            ret = -1;
+            break;
+        }
+        stats->raw_bytes += n;
+        stats->stored_bytes += sizeof(header) + header.stored_size;
+    }
+    if (n < 0) {
+        ret = -1;
+    }
+
+    free(raw);
+    free(packed);
+    return ret;
+}
+
+/* Decompress the blocks read from fd_in and write the raw data to fd_out */
+static int decompress_stream(int fd_in, int fd_out, CODEC_STATS * stats)
+{
+    char * raw = malloc(CODEC_BLOCK_SIZE);
+    char * packed = malloc(CODEC_BLOCK_SIZE);
+    if (!raw || !packed) {
+        free(raw);
+        free(packed);
+        return -1;
+    }
+
+    int ret = 0;
+    CODEC_BLOCK_HEADER header;
+    ssize_t n;
+    while ((n = read_full(fd_in, (char *)&header, sizeof(header))) == sizeof(header)) {
+        if (header.raw_size > CODEC_BLOCK_SIZE || header.stored_size > header.raw_size ||
+            read_full(fd_in, packed, header.stored_size) != header.stored_size) {
+            ret = -1;
+            break;
+        }
+
+        const char * body = packed;
+        if (header.stored_size < header.raw_size) {
+            struct timeval start;
+            gettimeofday(&start, NULL);
+            int raw_size = codec_decompress_block(packed, header.stored_size, raw, CODEC_BLOCK_SIZE);
+            stats->codec_time += elapsed_us(&start);
+            if (raw_size != (int)header.raw_size) {
+                ret = -1;
+                break;
+            }
+            body = raw;
+        }
+
+        if (write_full(fd_out, body, header.raw_size) < 0) {
+            ret = -1;
+            break;
+        }
+        stats->raw_bytes += header.raw_size;
+        stats->stored_bytes += sizeof(header) + header.stored_size;
+    }
+    if (n != 0 && ret == 0) {
+        ret = -1; /* A truncated header */
+    }
+
+    free(raw);
+    free(packed);
+    return ret;
+}
+
+/* Start a codec process that compresses into fd_out whatever is written to the returned file descriptor.
+   @param fd_out: The file descriptor of the compressed intermediate file.
+   @param stats: Where the codec process records its statistics; it should be shared memory.
+   @param p_pid: Receives the process ID of the codec process.
+   @ret: The write end of a pipe to the codec process, or -1 on error. Close it, then call codec_wait().
+ */
+int codec_start_writer(int fd_out, CODEC_STATS * stats, pid_t * p_pid)
+{
+    int pipe_fd[2];
+    if (pipe(pipe_fd) < 0) {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        close(pipe_fd[1]);
+        int ret = compress_stream(pipe_fd[0], fd_out, stats);
+        close(pipe_fd[0]);
+        close(fd_out);
+        _exit(ret < 0 ? 1 : 0);
+    }
+
+    close(pipe_fd[0]);
+    *p_pid = pid;
+    return pipe_fd[1];
+}
+
+/* Start a codec process that decompresses fd_in into the returned file descriptor.
+   @param fd_in: The file descriptor of the compressed intermediate file.
+   @param stats: Where the codec process records its statistics; it should be shared memory.
+   @param p_pid: Receives the process ID of the codec process.
+   @ret: The read end of a pipe from the codec process, or -1 on error. Close it, then call codec_wait().
+ */
+int codec_start_reader(int fd_in, CODEC_STATS * stats, pid_t * p_pid)
+{
+    int pipe_fd[2];
+    if (pipe(pipe_fd) < 0) {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        close(pipe_fd[0]);
+        int ret = decompress_stream(fd_in, pipe_fd[1], stats);
+        close(pipe_fd[1]);
+        close(fd_in);
+        _exit(ret < 0 ? 1 : 0);
+    }
+
+    close(pipe_fd[1]);
+    *p_pid = pid;
+    return pipe_fd[0];
+}
+
+/* Wait for a codec process.
+   @ret: 0 if the codec process succeeded, -1 otherwise.
+ */
+int codec_wait(pid_t pid)
+{
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+/* Block compression of the intermediate data files.
+   The codec is a small LZ4-block-format compressor kept in this tree so that no
+   external library is needed. An intermediate file is a sequence of blocks, each
+   preceded by a CODEC_BLOCK_HEADER, so a reader can decompress it as a stream. */
+
+#ifndef _CODEC_H
+#define _CODEC_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CODEC_BLOCK_SIZE (256 * 1024) /* The uncompressed size of a full block */
+
+/* The header in front of every block of a compressed intermediate file */
+typedef struct _codec_block_header
+{
+    uint32_t raw_size; /* The size of the block before compression */
+    uint32_t stored_size; /* The size of the block on disk; equal to raw_size if the block is stored verbatim */
+}CODEC_BLOCK_HEADER;
+
+/* Per-stream statistics, filled in by a codec process */
+typedef struct _codec_stats
+{
+    long raw_bytes; /* The number of uncompressed bytes that went through the codec */
+    long stored_bytes; /* The number of bytes on disk, block headers included */
+    int codec_time; /* The time (in microseconds) spent compressing or decompressing */
+}CODEC_STATS;
+
+int codec_compress_bound(int raw_size);
+int codec_compress_block(const char * src, int src_size, char * dst, int dst_capacity);
+int codec_decompress_block(const char * src, int src_size, char * dst, int dst_capacity);
+
+int codec_start_writer(int fd_out, CODEC_STATS * stats, pid_t * p_pid);
+int codec_start_reader(int fd_in, CODEC_STATS * stats, pid_t * p_pid);
+int codec_wait(pid_t pid);
+
+#endif
@@ -0,0 +1,44 @@
+#include <errno.h>
+#include <unistd.h>
+#include "common.h"
+
+/* Read until size bytes are read or the end of the file is reached, retrying interrupted reads.
+   @ret: The number of bytes read, which is less than size only at the end of the file, or -1 on error.
+ */
+ssize_t read_full(int fd, void * buf, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, (char *)buf + done, size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/* Write all size bytes, retrying interrupted and partial writes.
+   @ret: 0 on success, -1 on error.
+ */
+int write_full(int fd, const void * buf, size_t size)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = write(fd, (const char *)buf + done, size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
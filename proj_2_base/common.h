@@ -1,8 +1,10 @@
-/* This file defines some helper macros that may be helpful. */
+/* This file defines some helper macros and functions that may be helpful. */
 
 #ifndef _COMMON_H
 #define _COMMON_H
 
+#include <sys/types.h>
+
 #define SUCCESS  0
 #define ERROR    -1
 
@@ -31,4 +33,7 @@
         _exit(v);              \
     } while(0)
 
+ssize_t read_full(int fd, void * buf, size_t size);
+int write_full(int fd, const void * buf, size_t size);
+
 #endif
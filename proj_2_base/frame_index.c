@@ -0,0 +1,588 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "frame_index.h"
+#include "common.h"
+
+#define IO_CHUNK (64 * 1024)
+
+#define ZSTD_MAGIC           0xFD2FB528U
+#define ZSTD_SKIPPABLE_MAGIC 0x184D2A50U /* The low 4 bits may take any value */
+
+
+/* Where decompressed data goes. The sink can drop the bytes of a line that belongs to
+   the previous split, and stop once the last line of the split is complete. */
+typedef struct _frame_sink
+{
+    int fd_out; /* The file descriptor the data is written to, or -1 to discard it */
+    int skip_line; /* Drop the data up to and including the next newline */
+    int stop_at_line; /* Stop after passing the next newline */
+    int stopped; /* Set once stop_at_line has taken effect */
+    char last; /* The last byte passed through */
+    long written; /* The number of bytes passed through */
+}FRAME_SINK;
+
+
+static uint32_t get_le(const unsigned char * p, int len)
+{
+    uint32_t v = 0;
+    for (int i = len - 1; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static int sink_put(FRAME_SINK * sink, const char * buf, size_t len)
+{
+    if (sink->skip_line) {
+        const char * nl = memchr(buf, '\n', len);
+        if (!nl) {
+            return 0;
+        }
+        sink->skip_line = 0;
+        len -= nl + 1 - buf;
+        buf = nl + 1;
+    }
+    if (sink->stop_at_line) {
+        const char * nl = memchr(buf, '\n', len);
+        if (nl) {
+            len = nl + 1 - buf;
+            sink->stopped = 1;
+        }
+    }
+    if (len == 0) {
+        return 0;
+    }
+    if (sink->fd_out >= 0 && write_full(sink->fd_out, buf, len) < 0) {
+        return -1;
+    }
+    sink->last = buf[len - 1];
+    sink->written += len;
+    return 0;
+}
+
+static int add_frame(FRAME_INDEX * index, int * capacity, off_t offset, off_t size, long raw_size, int last_byte)
+{
+    if (index->frame_num == *capacity) {
+        int new_capacity = *capacity ? 2 * *capacity : 64;
+        FRAME * frames = realloc(index->frames, new_capacity * sizeof(FRAME));
+        if (!frames) {
+            return -1;
+        }
+        index->frames = frames;
+        *capacity = new_capacity;
+    }
+    index->frames[index->frame_num].offset = offset;
+    index->frames[index->frame_num].size = size;
+    index->frames[index->frame_num].raw_size = raw_size;
+    index->frames[index->frame_num].last_byte = last_byte;
+    index->frame_num++;
+    return 0;
+}
+
+/* Index a bgzip file by following the block sizes recorded in the "BC" extra subfield
+   of every member header. Nothing is decompressed.
+   @ret: 0 on success, -1 if the file is not a bgzip file.
+ */
+static int index_bgzf(int fd, off_t file_size, FRAME_INDEX * index)
+{
+    int capacity = 0;
+    off_t offset = 0;
+
+    while (offset < file_size) {
+        unsigned char header[12];
+        unsigned char extra[256];
+        if (pread(fd, header, sizeof(header), offset) != sizeof(header) ||
+            header[0] != 0x1f || header[1] != 0x8b || header[2] != 8 || !(header[3] & 4)) {
+            return -1;
+        }
+
+        int xlen = get_le(header + 10, 2);
+        if (xlen > (int)sizeof(extra) || pread(fd, extra, xlen, offset + sizeof(header)) != xlen) {
+            return -1;
+        }
+
+        long block_size = -1;
+        for (int i = 0; i + 4 <= xlen; ) {
+            int slen = get_le(extra + i + 2, 2);
+            if (extra[i] == 'B' && extra[i + 1] == 'C' && slen == 2 && i + 6 <= xlen) {
+                block_size = get_le(extra + i + 4, 2) + 1;
+                break;
+            }
+            i += 4 + slen;
+        }
+        if (block_size < 0 || offset + block_size > file_size) {
+            return -1;
+        }
+
+        unsigned char isize[4];
+        if (pread(fd, isize, sizeof(isize), offset + block_size - 4) != sizeof(isize) ||
+            add_frame(index, &capacity, offset, block_size, get_le(isize, 4), FRAME_LAST_UNKNOWN) < 0) {
+            return -1;
+        }
+        offset += block_size;
+    }
+
+    return 0;
+}
+
+/* Index any multi-member gzip file. Member boundaries are not recorded in the headers,
+   so this inflates the whole file once, and records the last byte of every member on the way
+   so that a map worker never has to inflate the member before its split again.
+   @ret: 0 on success, -1 on error.
+ */
+static int index_gzip_members(int fd, off_t file_size, FRAME_INDEX * index)
+{
+    unsigned char * in = malloc(IO_CHUNK);
+    unsigned char * out = malloc(IO_CHUNK);
+    z_stream strm;
+    int capacity = 0;
+    int ret = -1;
+
+    memset(&strm, 0, sizeof(strm));
+    if (!in || !out || inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK) {
+        free(in);
+        free(out);
+        return -1;
+    }
+
+    off_t pos = 0;
+    off_t member_start = 0;
+    int last_byte = -1;
+    while (1) {
+        if (strm.avail_in == 0) {
+            ssize_t n = pread(fd, in, IO_CHUNK, pos);
+            if (n < 0) {
+                break;
+            }
+            if (n == 0) {
+                ret = member_start == file_size ? 0 : -1;
+                break;
+            }
+            pos += n;
+            strm.next_in = in;
+            strm.avail_in = n;
+        }
+
+        strm.next_out = out;
+        strm.avail_out = IO_CHUNK;
+        int z = inflate(&strm, Z_NO_FLUSH);
+        if (strm.avail_out < IO_CHUNK) {
+            last_byte = out[IO_CHUNK - strm.avail_out - 1];
+        }
+        if (z == Z_STREAM_END) {
+            off_t member_end = pos - strm.avail_in;
+            if (add_frame(index, &capacity, member_start, member_end - member_start, strm.total_out, last_byte) < 0) {
+                break;
+            }
+            member_start = member_end;
+            last_byte = -1;
+            inflateReset(&strm);
+        } else if (z != Z_OK && !(z == Z_BUF_ERROR && strm.avail_in == 0)) {
+            break;
+        }
+    }
+
+    inflateEnd(&strm);
+    free(in);
+    free(out);
+    return ret;
+}
+
+/* Index a zstd file by walking the frame and block headers. Nothing is decompressed.
+   Skippable frames, such as the seek table of the seekable format, are left out of the index.
+   @ret: 0 on success, -1 on error.
+ */
+static int index_zstd(int fd, off_t file_size, FRAME_INDEX * index)
+{
+    static const int dict_id_sizes[4] = { 0, 1, 2, 4 };
+    static const int content_size_sizes[4] = { 0, 2, 4, 8 };
+    int capacity = 0;
+    off_t offset = 0;
+
+    while (offset < file_size) {
+        unsigned char header[18];
+        if (pread(fd, header, 8, offset) != 8) {
+            return -1;
+        }
+
+        uint32_t magic = get_le(header, 4);
+        if ((magic & 0xFFFFFFF0U) == ZSTD_SKIPPABLE_MAGIC) {
+            offset += 8 + (off_t)get_le(header + 4, 4);
+            continue;
+        }
+        if (magic != ZSTD_MAGIC) {
+            return -1;
+        }
+
+        int descriptor = header[4];
+        int single_segment = (descriptor >> 5) & 1;
+        int has_checksum = (descriptor >> 2) & 1;
+        int dict_id_size = dict_id_sizes[descriptor & 3];
+        int content_size_size = content_size_sizes[descriptor >> 6];
+        if (content_size_size == 0 && single_segment) {
+            content_size_size = 1;
+        }
+        int header_size = 5 + !single_segment + dict_id_size + content_size_size;
+        if (pread(fd, header, header_size, offset) != header_size) {
+            return -1;
+        }
+
+        long raw_size = -1;
+        if (content_size_size > 0) {
+            const unsigned char * p = header + header_size - content_size_size;
+            if (content_size_size == 8) {
+                raw_size = (long)(((uint64_t)get_le(p + 4, 4) << 32) | get_le(p, 4));
+            } else {
+                raw_size = get_le(p, content_size_size) + (content_size_size == 2 ? 256 : 0);
+            }
+        }
+
+        off_t pos = offset + header_size;
+        int last_block = 0;
+        while (!last_block) {
+            unsigned char block[3];
+            if (pread(fd, block, sizeof(block), pos) != sizeof(block)) {
+                return -1;
+            }
+            uint32_t block_header = get_le(block, 3);
+            int block_type = (block_header >> 1) & 3;
+            last_block = block_header & 1;
+            if (block_type == 3) {
+                return -1;
+            }
+            pos += sizeof(block) + (block_type == 1 ? 1 : (block_header >> 3));
+        }
+        if (has_checksum) {
+            pos += 4;
+        }
+        if (pos > file_size || add_frame(index, &capacity, offset, pos - offset, raw_size, FRAME_LAST_UNKNOWN) < 0) {
+            return -1;
+        }
+        offset = pos;
+    }
+
+    return 0;
+}
+
+static int decompress_gzip_frame(int fd, FRAME * frame, FRAME_SINK * sink)
+{
+    unsigned char * in = malloc(IO_CHUNK);
+    unsigned char * out = malloc(IO_CHUNK);
+    z_stream strm;
+    int ret = -1;
+
+    memset(&strm, 0, sizeof(strm));
+    if (!in || !out || inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK) {
+        free(in);
+        free(out);
+        return -1;
+    }
+
+    off_t pos = frame->offset;
+    off_t frame_end = frame->offset + frame->size;
+    while (!sink->stopped) {
+        if (strm.avail_in == 0) {
+            size_t want = frame_end - pos < IO_CHUNK ? frame_end - pos : IO_CHUNK;
+            ssize_t n = want > 0 ? pread(fd, in, want, pos) : 0;
+            if (n <= 0) {
+                break; /* The member ended before its trailer */
+            }
+            pos += n;
+            strm.next_in = in;
+            strm.avail_in = n;
+        }
+
+        strm.next_out = out;
+        strm.avail_out = IO_CHUNK;
+        int z = inflate(&strm, Z_NO_FLUSH);
+        if (z != Z_OK && z != Z_STREAM_END && !(z == Z_BUF_ERROR && strm.avail_in == 0)) {
+            break;
+        }
+        if (sink_put(sink, (char *)out, IO_CHUNK - strm.avail_out) < 0) {
+            break;
+        }
+        if (z == Z_STREAM_END) {
+            ret = 0;
+            break;
+        }
+    }
+    if (sink->stopped) {
+        ret = 0;
+    }
+
+    inflateEnd(&strm);
+    free(in);
+    free(out);
+    return ret;
+}
+
+#ifdef HAVE_ZSTD
+static int decompress_zstd_frame(int fd, FRAME * frame, FRAME_SINK * sink)
+{
+    char * in = malloc(IO_CHUNK);
+    size_t out_capacity = ZSTD_DStreamOutSize();
+    char * out = malloc(out_capacity);
+    ZSTD_DCtx * dctx = ZSTD_createDCtx();
+    int ret = -1;
+
+    if (!in || !out || !dctx) {
+        free(in);
+        free(out);
+        ZSTD_freeDCtx(dctx);
+        return -1;
+    }
+
+    off_t pos = frame->offset;
+    off_t frame_end = frame->offset + frame->size;
+    ZSTD_inBuffer input = { in, 0, 0 };
+    while (!sink->stopped) {
+        if (input.pos == input.size) {
+            size_t want = frame_end - pos < IO_CHUNK ? frame_end - pos : IO_CHUNK;
+            ssize_t n = want > 0 ? pread(fd, in, want, pos) : 0;
+            if (n <= 0) {
+                break;
+            }
+            pos += n;
+            input.size = n;
+            input.pos = 0;
+        }
+
+        ZSTD_outBuffer output = { out, out_capacity, 0 };
+        size_t z = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(z) || sink_put(sink, out, output.pos) < 0) {
+            break;
+        }
+        if (z == 0) {
+            ret = 0;
+            break;
+        }
+    }
+    if (sink->stopped) {
+        ret = 0;
+    }
+
+    ZSTD_freeDCtx(dctx);
+    free(in);
+    free(out);
+    return ret;
+}
+#endif
+
+static int decompress_frame(int fd, int format, FRAME * frame, FRAME_SINK * sink)
+{
+    if (format == INPUT_GZIP) {
+        return decompress_gzip_frame(fd, frame, sink);
+    }
+#ifdef HAVE_ZSTD
+    if (format == INPUT_ZSTD) {
+        return decompress_zstd_frame(fd, frame, sink);
+    }
+#endif
+    return -1;
+}
+
+/* Detect the format of an input file from its magic number.
+   @ret: One of the INPUT_* formats.
+ */
+int frame_detect_format(int fd)
+{
+    unsigned char magic[4];
+    if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic)) {
+        return INPUT_PLAIN;
+    }
+    if (magic[0] == 0x1f && magic[1] == 0x8b) {
+        return INPUT_GZIP;
+    }
+    uint32_t v = get_le(magic, 4);
+    if (v == ZSTD_MAGIC || (v & 0xFFFFFFF0U) == ZSTD_SKIPPABLE_MAGIC) {
+        return INPUT_ZSTD;
+    }
+    return INPUT_PLAIN;
+}
+
+/* Build the frame index of a compressed input file.
+   @param fd: The file descriptor of the input file.
+   @param format: INPUT_GZIP or INPUT_ZSTD.
+   @param index: The index to fill in; release it with frame_index_free().
+   @ret: 0 on success, -1 on error.
+ */
+int frame_index_build(int fd, int format, FRAME_INDEX * index)
+{
+    off_t file_size = lseek(fd, 0, SEEK_END);
+    int ret = -1;
+
+    memset(index, 0, sizeof(*index));
+    index->format = format;
+
+    if (format == INPUT_GZIP) {
+        ret = index_bgzf(fd, file_size, index);
+        if (ret < 0) {
+            index->frame_num = 0;
+            ret = index_gzip_members(fd, file_size, index);
+        }
+    } else if (format == INPUT_ZSTD) {
+#ifndef HAVE_ZSTD
+        ERR_MSG("zstd input needs a build with HAVE_ZSTD (make ZSTD=1)\n");
+        return -1;
+#endif
+        ret = index_zstd(fd, file_size, index);
+    }
+
+    if (ret < 0) {
+        frame_index_free(index);
+    }
+    return ret;
+}
+
+void frame_index_free(FRAME_INDEX * index)
+{
+    free(index->frames);
+    index->frames = NULL;
+    index->frame_num = 0;
+}
+
+/* The last decompressed byte of frame j, taken from the index when it is recorded there.
+   @param p_last: Receives the byte, or -1 if the frame is empty.
+   @ret: 0 on success, -1 on error.
+ */
+static int frame_last_byte(int fd, FRAME_INDEX * index, int j, int * p_last)
+{
+    if (index->frames[j].last_byte != FRAME_LAST_UNKNOWN) {
+        *p_last = index->frames[j].last_byte;
+        return 0;
+    }
+
+    FRAME_SINK probe;
+    memset(&probe, 0, sizeof(probe));
+    probe.fd_out = -1;
+    if (decompress_frame(fd, index->format, &index->frames[j], &probe) < 0) {
+        return -1;
+    }
+    *p_last = probe.written > 0 ? (unsigned char)probe.last : -1;
+    return 0;
+}
+
+/* Whether a split starting at frame first starts on a line boundary, which it does only if
+   the data before it ends with a newline.
+   @ret: 1 if it does, 0 if it starts in the middle of a line, or -1 on error.
+ */
+static int split_starts_line(int fd, FRAME_INDEX * index, int first)
+{
+    for (int j = first - 1; j >= 0; j--) {
+        int last;
+        if (frame_last_byte(fd, index, j, &last) < 0) {
+            return -1;
+        }
+        if (last >= 0) {
+            return last == '\n';
+        }
+    }
+    return 1;
+}
+
+/* Decompress the lines of a split into fd_out.
+   A line belongs to the split holding its first byte, as for plain input: the split drops
+   the tail of a line that started in an earlier frame, and continues into the following
+   frames until its own last line is complete.
+   @param fd: The file descriptor of the compressed input file.
+   @param index: The frame index of the input file.
+   @param first: The first frame of the split.
+   @param end: One past the last frame of the split.
+   @param fd_out: The file descriptor the decompressed split is written to.
+   @ret: The number of bytes written, or -1 on error.
+ */
+long frame_extract_split(int fd, FRAME_INDEX * index, int first, int end, int fd_out)
+{
+    FRAME_SINK sink;
+
+    memset(&sink, 0, sizeof(sink));
+    sink.fd_out = fd_out;
+
+    if (first >= end) {
+        return 0;
+    }
+
+    int starts_line = split_starts_line(fd, index, first);
+    if (starts_line < 0) {
+        return -1;
+    }
+    sink.skip_line = !starts_line;
+
+    for (int j = first; j < end; j++) {
+        if (decompress_frame(fd, index->format, &index->frames[j], &sink) < 0) {
+            return -1;
+        }
+    }
+
+    if (sink.skip_line || sink.written == 0 || sink.last == '\n') {
+        return sink.written;
+    }
+
+    sink.stop_at_line = 1;
+    for (int j = end; j < index->frame_num && !sink.stopped; j++) {
+        if (decompress_frame(fd, index->format, &index->frames[j], &sink) < 0) {
+            return -1;
+        }
+    }
+
+    return sink.written;
+}
+
+/* Find what frame_extract_split() reads outside a split's own frames, so that a cache key can
+   cover it: whether the data before the split ends in the middle of a line, and the following
+   frames the split's last line runs into. Only the split's last frame and the frames after it
+   are decompressed, and only where the index does not record their last byte.
+   @param fd: The file descriptor of the compressed input file.
+   @param index: The frame index of the input file.
+   @param first: The first frame of the split.
+   @param end: One past the last frame of the split.
+   @param p_skip_line: Receives 1 if the split starts in the middle of a line, 0 otherwise.
+   @param p_tail_end: Receives one past the last frame the split reads; this may count a frame
+                      more than it needs, but never one less.
+   @ret: 0 on success, -1 on error.
+ */
+int frame_split_context(int fd, FRAME_INDEX * index, int first, int end, int * p_skip_line, int * p_tail_end)
+{
+    int starts_line = first < end ? split_starts_line(fd, index, first) : 1;
+    if (starts_line < 0) {
+        return -1;
+    }
+    *p_skip_line = !starts_line;
+    *p_tail_end = end;
+
+    int last = -1;
+    for (int j = end - 1; j >= first && last < 0; j--) {
+        if (frame_last_byte(fd, index, j, &last) < 0) {
+            return -1;
+        }
+    }
+    if (last < 0 || last == '\n') {
+        return 0;
+    }
+
+    for (int j = end; j < index->frame_num; j++) {
+        *p_tail_end = j + 1;
+        if (index->frames[j].last_byte == '\n') {
+            break;
+        }
+
+        FRAME_SINK probe;
+        memset(&probe, 0, sizeof(probe));
+        probe.fd_out = -1;
+        probe.stop_at_line = 1;
+        if (decompress_frame(fd, index->format, &index->frames[j], &probe) < 0) {
+            return -1;
+        }
+        if (probe.stopped) {
+            break;
+        }
+    }
+    return 0;
+}
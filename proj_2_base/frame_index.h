@@ -0,0 +1,39 @@
+/* Block-splittable compressed input files.
+   A gzip file made of concatenated members (such as a bgzip file) or a zstd file made of
+   several frames can be decompressed one frame at a time. The frame index records where
+   every frame starts so that whole frames can be handed to different map workers. */
+
+#ifndef _FRAME_INDEX_H
+#define _FRAME_INDEX_H
+
+#include <sys/types.h>
+
+#define INPUT_PLAIN 0 /* Not compressed */
+#define INPUT_GZIP  1 /* Concatenated gzip members */
+#define INPUT_ZSTD  2 /* Concatenated zstd frames; decompression needs a build with HAVE_ZSTD */
+
+#define FRAME_LAST_UNKNOWN (-2) /* FRAME.last_byte of a frame that was not decompressed while indexing */
+
+/* One independently decompressible frame of the input file */
+typedef struct _frame
+{
+    off_t offset; /* The offset of the frame in the compressed file */
+    off_t size; /* The compressed size of the frame */
+    long raw_size; /* The decompressed size of the frame, or -1 if the frame header does not record it */
+    int last_byte; /* The last decompressed byte of the frame, -1 if it is empty, or FRAME_LAST_UNKNOWN */
+}FRAME;
+
+typedef struct _frame_index
+{
+    int format; /* One of the INPUT_* formats */
+    int frame_num; /* The number of frames */
+    FRAME * frames; /* The frames, in file order */
+}FRAME_INDEX;
+
+int frame_detect_format(int fd);
+int frame_index_build(int fd, int format, FRAME_INDEX * index);
+void frame_index_free(FRAME_INDEX * index);
+long frame_extract_split(int fd, FRAME_INDEX * index, int first, int end, int fd_out);
+int frame_split_context(int fd, FRAME_INDEX * index, int first, int end, int * p_skip_line, int * p_tail_end);
+
+#endif
@@ -0,0 +1,743 @@
+#define _GNU_SOURCE /* struct ucred */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <dirent.h>
+#include <grp.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/signalfd.h>
+#include "job_server.h"
+#include "common.h"
+
+#define JOB_QUEUE_MAX 1024 /* Requests past this many queued jobs are turned away */
+#define REQUEST_TIMEOUT_SEC 5 /* How long a client may take to send its request */
+
+
+/* A job, from its request until its job process exits */
+typedef struct _server_job
+{
+    int fd; /* The client connection; the server closes its copy once the job starts */
+    char * request; /* The request payload */
+    const char * cwd; /* The client's working directory, in request */
+    int argc;
+    char ** argv; /* The job's arguments, in request */
+    int slots; /* The number of map workers the job asks for */
+    uid_t uid; /* The client's user and group, which the job runs as */
+    gid_t gid;
+    pid_t sid; /* The session of the client process, which picks the job's queue */
+    pid_t pid; /* The job's runner process, once started */
+    JOB_FRAME_HEADER header; /* The request's header, while it is read */
+    size_t received; /* The bytes of the request frame read so far */
+    long deadline_ms; /* When a request still incomplete is given up */
+    struct _server_job * next;
+}SERVER_JOB;
+
+/* The jobs of one client, first come first served. A client is a login session of a user
+   (a terminal, an ssh login, a cron run), so that a script queueing many jobs from one
+   session does not hold up the jobs of another, even when both run as the same user. */
+typedef struct _client_queue
+{
+    uid_t uid;
+    pid_t sid;
+    SERVER_JOB * head;
+    SERVER_JOB * tail;
+}CLIENT_QUEUE;
+
+typedef struct _job_server
+{
+    int slot_budget; /* The most map workers running jobs may ask for together */
+    int slots_used;
+    CLIENT_QUEUE * clients;
+    int client_num;
+    int client_capacity;
+    int next_client; /* Where the round-robin over client queues resumes */
+    int queued_num;
+    SERVER_JOB * reading; /* The connections whose requests are being read */
+    int reading_num;
+    SERVER_JOB * running; /* The jobs started and not yet finished */
+    int running_num;
+    JOB_FUNC run_job;
+    int listen_fd;
+    int signal_fd;
+    sigset_t saved_mask; /* The signal mask before the server blocked the signals it reads */
+}JOB_SERVER;
+
+
+static int send_frame(int fd, uint32_t type, const void * payload, uint32_t len)
+{
+    JOB_FRAME_HEADER header = { .type = type, .len = len };
+    if (write_full(fd, &header, sizeof(header)) < 0) {
+        return -1;
+    }
+    return write_full(fd, payload, len);
+}
+
+static void send_exit(int fd, int status)
+{
+    int32_t value = status;
+    send_frame(fd, JOB_FRAME_EXIT, &value, sizeof(value));
+}
+
+static void send_text(int fd, const char * text)
+{
+    send_frame(fd, JOB_FRAME_OUTPUT, text, strlen(text));
+}
+
+static void free_job(SERVER_JOB * job)
+{
+    if (job->fd >= 0) {
+        close(job->fd);
+    }
+    free(job->request);
+    free(job->argv);
+    free(job);
+}
+
+/* Remove a job's working directory. A job killed with the server may leave its scratch
+   directory in it, so subdirectories are removed too. */
+static void remove_work_dir(const char * work_dir)
+{
+    DIR * dir = opendir(work_dir);
+    if (dir) {
+        struct dirent * entry;
+        while ((entry = readdir(dir))) {
+            if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
+                char path[4096];
+                snprintf(path, sizeof(path), "%s/%s", work_dir, entry->d_name);
+                if (entry->d_type == DT_DIR) {
+                    remove_work_dir(path);
+                } else {
+                    unlink(path);
+                }
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(work_dir);
+}
+
+/* The body of a job's runner process; it does not return.
+   The runner starts the job process in a fresh working directory, forwards what it prints,
+   then sends the result file and the exit status, and removes the directory.
+ */
+static void run_runner(JOB_SERVER * server, SERVER_JOB * job)
+{
+    const char * tmp_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char work_dir[4096];
+    snprintf(work_dir, sizeof(work_dir), "%s/mr-job.XXXXXX", tmp_dir);
+
+    /* A server running as root runs the job as its client, who must be able to use the directory */
+    int out[2];
+    if (!mkdtemp(work_dir) || (geteuid() == 0 && chown(work_dir, job->uid, job->gid) < 0) || pipe(out) < 0) {
+        send_text(job->fd, "The server failed to set up the job\n");
+        send_exit(job->fd, 2);
+        exit(0);
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        send_text(job->fd, "The server failed to start the job\n");
+        send_exit(job->fd, 2);
+        remove_work_dir(work_dir);
+        exit(0);
+    }
+
+    if (pid == 0) {
+        signal(SIGPIPE, SIG_DFL);
+        close(out[0]);
+        close(job->fd);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(out[1], STDERR_FILENO);
+        close(out[1]);
+        if (geteuid() == 0 && (setgroups(0, NULL) < 0 || setgid(job->gid) < 0 || setuid(job->uid) < 0)) {
+            printf("Failed to switch to the client's user\n");
+            exit(2);
+        }
+        if (chdir(job->cwd) < 0) {
+            printf("Failed to enter directory %s\n", job->cwd);
+            exit(2);
+        }
+        exit(server->run_job(job->argc, job->argv, work_dir));
+    }
+
+    /* A client that goes away must not stop the cleanup, so write errors are ignored */
+    close(out[1]);
+    char buf[JOB_FRAME_MAX];
+    ssize_t n;
+    while ((n = read(out[0], buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            break;
+        }
+        send_frame(job->fd, JOB_FRAME_OUTPUT, buf, n);
+    }
+    close(out[0]);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+
+    char result_path[4096 + 16];
+    snprintf(result_path, sizeof(result_path), "%s/mr.rst", work_dir);
+    int result_fd = open(result_path, O_RDONLY);
+    if (result_fd >= 0) {
+        /* An empty frame first, so that an empty result file still replaces the client's old one */
+        send_frame(job->fd, JOB_FRAME_RESULT, buf, 0);
+        while ((n = read(result_fd, buf, sizeof(buf))) > 0) {
+            send_frame(job->fd, JOB_FRAME_RESULT, buf, n);
+        }
+        close(result_fd);
+    }
+
+    send_exit(job->fd, WIFEXITED(status) ? WEXITSTATUS(status) : 2);
+    remove_work_dir(work_dir);
+    exit(0);
+}
+
+static void start_job(JOB_SERVER * server, SERVER_JOB * job)
+{
+    pid_t pid = fork();
+    if (pid < 0) {
+        ERR_MSG("Failed to fork a job runner\n");
+        send_text(job->fd, "The server failed to start the job\n");
+        send_exit(job->fd, 2);
+        free_job(job);
+        return;
+    }
+
+    if (pid == 0) {
+        close(server->listen_fd);
+        close(server->signal_fd);
+        for (SERVER_JOB * reading = server->reading; reading; reading = reading->next) {
+            close(reading->fd);
+        }
+        for (int i = 0; i < server->client_num; i++) {
+            for (SERVER_JOB * queued = server->clients[i].head; queued; queued = queued->next) {
+                close(queued->fd);
+            }
+        }
+        sigprocmask(SIG_SETMASK, &server->saved_mask, NULL);
+        run_runner(server, job);
+    }
+
+    /* The runner talks to the client from now on */
+    close(job->fd);
+    job->fd = -1;
+    job->pid = pid;
+    job->next = server->running;
+    server->running = job;
+    server->running_num++;
+    server->slots_used += job->slots;
+}
+
+/* Start queued jobs, taking the client queues in turn, while they fit in the slot budget.
+   A job larger than the whole budget runs once nothing else is running. The job whose turn it
+   is blocks the ones behind it, so a large job is not starved by smaller ones.
+ */
+static void admit_jobs(JOB_SERVER * server)
+{
+    while (server->queued_num > 0) {
+        int c = -1;
+        for (int k = 0; k < server->client_num && c < 0; k++) {
+            int i = (server->next_client + k) % server->client_num;
+            if (server->clients[i].head) {
+                c = i;
+            }
+        }
+
+        CLIENT_QUEUE * client = &server->clients[c];
+        SERVER_JOB * job = client->head;
+        if (server->running_num > 0 && server->slots_used + job->slots > server->slot_budget) {
+            break;
+        }
+
+        client->head = job->next;
+        if (!client->head) {
+            client->tail = NULL;
+        }
+        job->next = NULL;
+        server->queued_num--;
+        server->next_client = (c + 1) % server->client_num;
+        start_job(server, job);
+    }
+}
+
+static int enqueue_job(JOB_SERVER * server, SERVER_JOB * job)
+{
+    CLIENT_QUEUE * client = NULL;
+    for (int i = 0; i < server->client_num && !client; i++) {
+        if (server->clients[i].uid == job->uid && server->clients[i].sid == job->sid) {
+            client = &server->clients[i];
+        }
+    }
+
+    if (!client) {
+        if (server->client_num == server->client_capacity) {
+            int capacity = server->client_capacity ? 2 * server->client_capacity : 16;
+            CLIENT_QUEUE * clients = realloc(server->clients, capacity * sizeof(CLIENT_QUEUE));
+            if (!clients) {
+                return -1;
+            }
+            server->clients = clients;
+            server->client_capacity = capacity;
+        }
+        client = &server->clients[server->client_num++];
+        client->uid = job->uid;
+        client->sid = job->sid;
+        client->head = NULL;
+        client->tail = NULL;
+    }
+
+    if (client->tail) {
+        client->tail->next = job;
+    } else {
+        client->head = job;
+    }
+    client->tail = job;
+    server->queued_num++;
+    return 0;
+}
+
+static long now_ms(void)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec * 1000L + now.tv_usec / 1000;
+}
+
+/* Accept a new connection; its request is read as it arrives */
+static void accept_job(JOB_SERVER * server)
+{
+    int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    if (fd < 0) {
+        return;
+    }
+
+    SERVER_JOB * job = calloc(1, sizeof(SERVER_JOB));
+    if (!job) {
+        close(fd);
+        return;
+    }
+    job->fd = fd;
+
+    /* Jobs read and write files with the server's privileges, so only its own user may submit
+       them, unless the server runs as root and can run each job as its client */
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 ||
+        (geteuid() != 0 && cred.uid != geteuid())) {
+        send_text(fd, "Permission denied: the server runs jobs for its own user only\n");
+        send_exit(fd, 1);
+        free_job(job);
+        return;
+    }
+    job->uid = cred.uid;
+    job->gid = cred.gid;
+    /* A client whose session cannot be looked up is a client of its own */
+    job->sid = getsid(cred.pid);
+    if (job->sid < 0) {
+        job->sid = cred.pid;
+    }
+
+    if (server->reading_num >= JOB_QUEUE_MAX) {
+        send_text(fd, "The server is busy; try again later\n");
+        send_exit(fd, 2);
+        free_job(job);
+        return;
+    }
+
+    /* A stalled client must not hold up the server, nor keep its connection forever */
+    job->deadline_ms = now_ms() + REQUEST_TIMEOUT_SEC * 1000L;
+    job->next = server->reading;
+    server->reading = job;
+    server->reading_num++;
+}
+
+/* Read what has arrived of a connection's request.
+   @ret: 1 once the request is complete, 0 while more is to come, -1 if the connection is to be
+         dropped.
+ */
+static int read_request(SERVER_JOB * job)
+{
+    for (;;) {
+        char * dst;
+        size_t size;
+        if (job->received < sizeof(job->header)) {
+            dst = (char *)&job->header + job->received;
+            size = sizeof(job->header) - job->received;
+        } else {
+            if (!job->request) {
+                if (job->header.type != JOB_FRAME_REQUEST || job->header.len == 0 || job->header.len > JOB_FRAME_MAX) {
+                    return -1;
+                }
+                job->request = malloc(job->header.len + 1);
+                if (!job->request) {
+                    return -1;
+                }
+            }
+            size_t done = job->received - sizeof(job->header);
+            if (done == job->header.len) {
+                job->request[done] = '\0';
+                return 1;
+            }
+            dst = job->request + done;
+            size = job->header.len - done;
+        }
+
+        ssize_t n = read(job->fd, dst, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        job->received += n;
+    }
+}
+
+/* Parse a complete request and queue its job */
+static void queue_job(JOB_SERVER * server, SERVER_JOB * job, JOB_SLOTS_FUNC job_slots)
+{
+    int fd = job->fd;
+    uint32_t len = job->header.len;
+
+    /* The runner writes to the client with blocking writes */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+    /* The working directory, then the arguments, each ending with a NUL */
+    int field_num = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        field_num += job->request[i] == '\0';
+    }
+    job->argc = field_num - 1;
+    job->argv = calloc(field_num + 1, sizeof(char *));
+    if (job->argc < 1 || !job->argv || job->request[len - 1] != '\0') {
+        send_text(fd, "Malformed job request\n");
+        send_exit(fd, 1);
+        free_job(job);
+        return;
+    }
+    job->cwd = job->request;
+    char * p = job->request + strlen(job->request) + 1;
+    for (int i = 0; i < job->argc; i++) {
+        job->argv[i] = p;
+        p += strlen(p) + 1;
+    }
+
+    if (server->queued_num >= JOB_QUEUE_MAX) {
+        send_text(fd, "The server is busy; try again later\n");
+        send_exit(fd, 2);
+        free_job(job);
+        return;
+    }
+
+    job->slots = job_slots(job->argc, job->argv);
+    if (enqueue_job(server, job) < 0) {
+        send_text(fd, "The server failed to queue the job\n");
+        send_exit(fd, 2);
+        free_job(job);
+    }
+}
+
+/* Read the connections whose poll entries are ready, queueing the jobs whose requests are
+   complete and dropping the connections that failed or are past their deadline.
+   @param fds: The poll entries of the connections, in the order of server->reading.
+ */
+static void read_requests(JOB_SERVER * server, struct pollfd * fds, JOB_SLOTS_FUNC job_slots)
+{
+    long now = now_ms();
+    SERVER_JOB ** link = &server->reading;
+    for (int i = 0; *link; i++) {
+        SERVER_JOB * job = *link;
+        int ret = 0;
+        if (fds[i].revents) {
+            ret = read_request(job);
+        }
+        if (ret == 0 && now >= job->deadline_ms) {
+            ret = -1;
+        }
+
+        if (ret == 0) {
+            link = &job->next;
+            continue;
+        }
+        *link = job->next;
+        job->next = NULL;
+        server->reading_num--;
+        if (ret > 0) {
+            queue_job(server, job, job_slots);
+        } else {
+            free_job(job);
+        }
+    }
+}
+
+/* Account for the job runners that have exited */
+static void reap_jobs(JOB_SERVER * server)
+{
+    pid_t pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (SERVER_JOB ** link = &server->running; *link; link = &(*link)->next) {
+            SERVER_JOB * job = *link;
+            if (job->pid == pid) {
+                *link = job->next;
+                server->running_num--;
+                server->slots_used -= job->slots;
+                free_job(job);
+                break;
+            }
+        }
+    }
+}
+
+/* Serve jobs until SIGINT or SIGTERM; queued jobs are then turned away and running ones finish.
+   @param socket_path: The path of the Unix domain socket to listen on; an old socket file is replaced.
+   @param slot_budget: The most map workers running jobs may ask for together.
+   @param run_job: Runs a job in a job process.
+   @param job_slots: Tells how many map workers a job asks for.
+   @ret: 0 after a clean shutdown, -1 on error.
+ */
+int job_server_run(const char * socket_path, int slot_budget, JOB_FUNC run_job, JOB_SLOTS_FUNC job_slots)
+{
+    JOB_SERVER server;
+    memset(&server, 0, sizeof(server));
+    server.slot_budget = slot_budget > 0 ? slot_budget : 1;
+    server.run_job = run_job;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        ERR_MSG("Socket path %s is too long\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server.listen_fd < 0) {
+        ERR_MSG("Failed to create socket\n");
+        return -1;
+    }
+    /* Only the server's user may connect, whatever the umask */
+    unlink(socket_path);
+    mode_t saved_umask = umask(0077);
+    int bound = bind(server.listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(saved_umask);
+    if (bound < 0 || chmod(socket_path, 0600) < 0 || listen(server.listen_fd, 64) < 0) {
+        ERR_MSG("Failed to listen on %s\n", socket_path);
+        close(server.listen_fd);
+        return -1;
+    }
+
+    /* Child exits and shutdown requests are read from a signalfd in the poll loop */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, &server.saved_mask);
+    server.signal_fd = signalfd(-1, &mask, 0);
+    if (server.signal_fd < 0) {
+        ERR_MSG("Failed to create signalfd\n");
+        close(server.listen_fd);
+        unlink(socket_path);
+        return -1;
+    }
+    /* A client that hangs up must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Serving jobs on %s with %d map worker slots\n", socket_path, server.slot_budget);
+
+    int stopping = 0;
+    struct pollfd fds[2 + JOB_QUEUE_MAX];
+    while (!stopping || server.running_num > 0) {
+        /* The signals, new connections, then the connections whose requests are being read */
+        int fd_num = 0;
+        long timeout_ms = -1;
+        fds[fd_num++] = (struct pollfd){ .fd = server.signal_fd, .events = POLLIN };
+        fds[fd_num++] = (struct pollfd){ .fd = stopping ? -1 : server.listen_fd, .events = POLLIN };
+        for (SERVER_JOB * job = server.reading; job; job = job->next) {
+            fds[fd_num++] = (struct pollfd){ .fd = job->fd, .events = POLLIN };
+            long left_ms = job->deadline_ms - now_ms();
+            if (timeout_ms < 0 || left_ms < timeout_ms) {
+                timeout_ms = left_ms > 0 ? left_ms : 0;
+            }
+        }
+
+        if (poll(fds, fd_num, timeout_ms) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ERR_MSG("Failed to poll\n");
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(server.signal_fd, &info, sizeof(info)) == sizeof(info) &&
+                (info.ssi_signo == SIGINT || info.ssi_signo == SIGTERM) && !stopping) {
+                stopping = 1;
+                close(server.listen_fd);
+                unlink(socket_path);
+                for (int i = 0; i < server.client_num; i++) {
+                    while (server.clients[i].head) {
+                        SERVER_JOB * job = server.clients[i].head;
+                        server.clients[i].head = job->next;
+                        send_text(job->fd, "The server is shutting down\n");
+                        send_exit(job->fd, 2);
+                        free_job(job);
+                    }
+                    server.clients[i].tail = NULL;
+                }
+                server.queued_num = 0;
+                while (server.reading) {
+                    SERVER_JOB * job = server.reading;
+                    server.reading = job->next;
+                    free_job(job);
+                }
+                server.reading_num = 0;
+            }
+            reap_jobs(&server);
+        }
+
+        if (!stopping) {
+            read_requests(&server, fds + 2, job_slots);
+        }
+
+        if (!stopping && (fds[1].revents & POLLIN)) {
+            accept_job(&server);
+        }
+
+        if (!stopping) {
+            admit_jobs(&server);
+        }
+    }
+
+    if (!stopping) {
+        close(server.listen_fd);
+        unlink(socket_path);
+    }
+    close(server.signal_fd);
+    sigprocmask(SIG_SETMASK, &server.saved_mask, NULL);
+    free(server.clients);
+    return 0;
+}
+
+/* Submit a job to a server and wait for it.
+   What the job prints is copied to stdout, and its result file is written to output_path, as
+   if the job had run here. The file is replaced only once the whole result has arrived.
+   @param socket_path: The server's socket.
+   @param argc, argv: The job's command line, argv[0] included.
+   @param output_path: Where to write the result file.
+   @ret: The job's exit status, or 2 if the server could not be reached.
+ */
+int job_client_run(const char * socket_path, int argc, char * argv[], const char * output_path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        printf("Socket path %s is too long\n", socket_path);
+        return 2;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        printf("Failed to get the working directory\n");
+        return 2;
+    }
+
+    size_t len = strlen(cwd) + 1;
+    for (int i = 0; i < argc; i++) {
+        len += strlen(argv[i]) + 1;
+    }
+    if (len > JOB_FRAME_MAX) {
+        printf("The job's command line is too long\n");
+        return 2;
+    }
+
+    char * request = malloc(len);
+    if (!request) {
+        return 2;
+    }
+    char * p = stpcpy(request, cwd) + 1;
+    for (int i = 0; i < argc; i++) {
+        p = stpcpy(p, argv[i]) + 1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        printf("Failed to connect to the server at %s\n", socket_path);
+        free(request);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 2;
+    }
+
+    /* A server refusing the job may close the connection before reading it, after saying why */
+    signal(SIGPIPE, SIG_IGN);
+    int sent = send_frame(fd, JOB_FRAME_REQUEST, request, len);
+    free(request);
+
+    char result_temp[4096];
+    snprintf(result_temp, sizeof(result_temp), "%s.%d.tmp", output_path, getpid());
+
+    char * buf = malloc(JOB_FRAME_MAX);
+    int result_fd = -1;
+    int status = -1;
+    JOB_FRAME_HEADER header;
+    while (buf && status < 0 && read_full(fd, &header, sizeof(header)) == sizeof(header) && header.len <= JOB_FRAME_MAX) {
+        if (read_full(fd, buf, header.len) != header.len) {
+            break;
+        }
+
+        if (header.type == JOB_FRAME_OUTPUT) {
+            fwrite(buf, 1, header.len, stdout);
+        } else if (header.type == JOB_FRAME_RESULT) {
+            if (result_fd < 0) {
+                result_fd = open(result_temp, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+            }
+            if (result_fd < 0 || write_full(result_fd, buf, header.len) < 0) {
+                printf("Failed to write the result file\n");
+                status = 2;
+            }
+        } else if (header.type == JOB_FRAME_EXIT && header.len == sizeof(int32_t)) {
+            int32_t value;
+            memcpy(&value, buf, sizeof(value));
+            status = value;
+        }
+    }
+
+    if (status < 0) {
+        printf(sent < 0 ? "Failed to send the job to the server\n" :
+               "The server closed the connection before the job finished\n");
+        status = 2;
+    }
+    if (result_fd >= 0) {
+        if (close(result_fd) < 0 || (status == 0 && rename(result_temp, output_path) < 0)) {
+            printf("Failed to write the result file\n");
+            status = 2;
+        }
+        unlink(result_temp);
+    }
+    free(buf);
+    close(fd);
+    return status;
+}
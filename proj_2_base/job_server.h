@@ -0,0 +1,45 @@
+/* The job server and its client.
+   The server is a daemon listening on a Unix domain socket. A client sends the command line of
+   a job, as run-mapreduce would take it, and the server queues it: one queue per client login
+   session (of any user, for a server running as root), served round-robin, and a job is
+   started only while the map workers of all running jobs fit in the server's slot budget. Every job runs in a process forked from the server, with its own
+   working directory for its scratch and result files; what it prints is streamed back as it
+   runs, then its result file.
+
+   The socket is open to the server's own user only, and other users' connections are refused.
+   A server running as root may have its socket opened to others; each job then runs as the
+   user and group of its client.
+
+   Every message is a JOB_FRAME_HEADER followed by len bytes. The request payload is the
+   client's working directory and then the job's arguments (argv[0] included), each ending
+   with a NUL. */
+
+#ifndef _JOB_SERVER_H
+#define _JOB_SERVER_H
+
+#include <stdint.h>
+
+#define JOB_FRAME_REQUEST 'q' /* Client to server: the job to run */
+#define JOB_FRAME_OUTPUT  'o' /* Server to client: text the job printed */
+#define JOB_FRAME_RESULT  'r' /* Server to client: the next bytes of the result file */
+#define JOB_FRAME_EXIT    'x' /* Server to client: the job's exit status, an int32_t; the last frame */
+
+#define JOB_FRAME_MAX (64 * 1024) /* The largest payload of a frame */
+
+typedef struct _job_frame_header
+{
+    uint32_t type; /* One of the JOB_FRAME_* types */
+    uint32_t len; /* The length of the payload */
+}JOB_FRAME_HEADER;
+
+/* Runs a job given its command line, from the directory the client ran in; a job process
+   calls it and exits with its return value. It leaves the result file in work_dir as mr.rst. */
+typedef int (*JOB_FUNC)(int argc, char * argv[], const char * work_dir);
+
+/* Returns the number of map workers a job's command line asks for */
+typedef int (*JOB_SLOTS_FUNC)(int argc, char * argv[]);
+
+int job_server_run(const char * socket_path, int slot_budget, JOB_FUNC run_job, JOB_SLOTS_FUNC job_slots);
+int job_client_run(const char * socket_path, int argc, char * argv[], const char * output_path);
+
+#endif
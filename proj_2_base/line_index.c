@@ -0,0 +1,474 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "line_index.h"
+#include "common.h"
+
+#define INITIAL_CAPACITY 1024
+#define LINE_CHUNK 4096
+
+
+static uint64_t term_hash(const char * term, int len)
+{
+    uint64_t h = 14695981039346656037ULL; /* FNV-1a */
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)term[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int term_compare(const char * a, int a_len, const char * b, int b_len)
+{
+    int n = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (n != 0) {
+        return n;
+    }
+    return a_len - b_len;
+}
+
+static int entry_compare(const void * a, const void * b)
+{
+    const TERM_ENTRY * x = *(TERM_ENTRY * const *)a;
+    const TERM_ENTRY * y = *(TERM_ENTRY * const *)b;
+    return term_compare(x->term, x->len, y->term, y->len);
+}
+
+static size_t put_varint(unsigned char * p, uint64_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+/* @ret: The number of bytes decoded, or 0 if the varint runs past end */
+static size_t get_varint(const unsigned char * p, const unsigned char * end, uint64_t * p_value)
+{
+    uint64_t v = 0;
+    size_t n = 0;
+    for (int shift = 0; p + n < end && shift < 64; shift += 7) {
+        unsigned char b = p[n++];
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *p_value = v;
+            return n;
+        }
+    }
+    return 0;
+}
+
+static TERM_ENTRY * find_slot(TERM_ENTRY * entries, size_t capacity, const char * term, int len)
+{
+    size_t i = term_hash(term, len) & (capacity - 1);
+    while (entries[i].term && term_compare(entries[i].term, entries[i].len, term, len) != 0) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &entries[i];
+}
+
+static int grow(LINE_INDEX_BUILDER * builder)
+{
+    size_t capacity = builder->capacity * 2;
+    TERM_ENTRY * entries = calloc(capacity, sizeof(TERM_ENTRY));
+    if (!entries) {
+        return -1;
+    }
+    for (size_t i = 0; i < builder->capacity; i++) {
+        if (builder->entries[i].term) {
+            *find_slot(entries, capacity, builder->entries[i].term, builder->entries[i].len) = builder->entries[i];
+        }
+    }
+    free(builder->entries);
+    builder->entries = entries;
+    builder->capacity = capacity;
+    return 0;
+}
+
+int line_index_builder_init(LINE_INDEX_BUILDER * builder)
+{
+    memset(builder, 0, sizeof(*builder));
+    builder->capacity = INITIAL_CAPACITY;
+    builder->entries = calloc(builder->capacity, sizeof(TERM_ENTRY));
+    return builder->entries ? 0 : -1;
+}
+
+void line_index_builder_free(LINE_INDEX_BUILDER * builder)
+{
+    for (size_t i = 0; i < builder->capacity; i++) {
+        free(builder->entries[i].term);
+        free(builder->entries[i].postings);
+    }
+    free(builder->entries);
+    memset(builder, 0, sizeof(*builder));
+}
+
+/* Record that the line at line_offset contains term. Lines must be added in increasing offset order.
+   @ret: 0 on success, -1 on error.
+ */
+int line_index_builder_add(LINE_INDEX_BUILDER * builder, const char * term, int len, uint64_t line_offset)
+{
+    if (2 * (builder->count + 1) > builder->capacity && grow(builder) < 0) {
+        return -1;
+    }
+
+    TERM_ENTRY * entry = find_slot(builder->entries, builder->capacity, term, len);
+    if (!entry->term) {
+        entry->term = malloc(len);
+        if (!entry->term) {
+            return -1;
+        }
+        memcpy(entry->term, term, len);
+        entry->len = len;
+        builder->count++;
+    } else if (entry->last_offset == line_offset) {
+        return 0; /* The word occurs more than once in the line */
+    }
+
+    if (entry->postings_size + 10 > entry->postings_capacity) {
+        size_t capacity = entry->postings_capacity ? 2 * entry->postings_capacity : 16;
+        unsigned char * postings = realloc(entry->postings, capacity);
+        if (!postings) {
+            return -1;
+        }
+        entry->postings = postings;
+        entry->postings_capacity = capacity;
+    }
+
+    uint64_t delta = entry->line_num ? line_offset - entry->last_offset : line_offset;
+    entry->postings_size += put_varint(entry->postings + entry->postings_size, delta);
+    entry->last_offset = line_offset;
+    entry->line_num++;
+    return 0;
+}
+
+/* Take the identity (size, inode and modification time) of the indexed input file from fd_input */
+int line_index_builder_identify(LINE_INDEX_BUILDER * builder, int fd_input)
+{
+    struct stat st;
+    if (fstat(fd_input, &st) < 0) {
+        return -1;
+    }
+    builder->identity.input_size = st.st_size;
+    builder->identity.input_ino = st.st_ino;
+    builder->identity.input_mtime_sec = st.st_mtim.tv_sec;
+    builder->identity.input_mtime_nsec = st.st_mtim.tv_nsec;
+    builder->has_identity = 1;
+    return 0;
+}
+
+/* Write the builder as intermediate data: a "#input" line with the input identity, then one
+   line per term, "term offset offset ...", with absolute line offsets.
+   @ret: 0 on success, -1 on error.
+ */
+int line_index_builder_write_text(LINE_INDEX_BUILDER * builder, int fd_out)
+{
+    FILE * out = fdopen(dup(fd_out), "w");
+    if (!out) {
+        return -1;
+    }
+
+    if (builder->has_identity) {
+        fprintf(out, "#input %llu %llu %lld %lld\n",
+                (unsigned long long)builder->identity.input_size, (unsigned long long)builder->identity.input_ino,
+                (long long)builder->identity.input_mtime_sec, (long long)builder->identity.input_mtime_nsec);
+    }
+
+    int ret = 0;
+    for (size_t i = 0; i < builder->capacity && ret == 0; i++) {
+        TERM_ENTRY * entry = &builder->entries[i];
+        if (!entry->term) {
+            continue;
+        }
+
+        fwrite(entry->term, 1, entry->len, out);
+        const unsigned char * p = entry->postings;
+        const unsigned char * end = p + entry->postings_size;
+        uint64_t offset = 0;
+        while (p < end) {
+            uint64_t delta;
+            size_t n = get_varint(p, end, &delta);
+            if (n == 0) {
+                ret = -1;
+                break;
+            }
+            p += n;
+            offset += delta;
+            fprintf(out, " %llu", (unsigned long long)offset);
+        }
+        fputc('\n', out);
+    }
+
+    if (fclose(out) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/* Add the intermediate data written by line_index_builder_write_text() to the builder, and close fd_in.
+   Files must be read in input order, so that the offsets of a term keep increasing.
+   @ret: 0 on success, -1 on error.
+ */
+int line_index_builder_read_text(LINE_INDEX_BUILDER * builder, int fd_in)
+{
+    FILE * in = fdopen(fd_in, "r");
+    if (!in) {
+        return -1;
+    }
+
+    char * line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_len;
+    int ret = 0;
+
+    while (ret == 0 && (line_len = getline(&line, &line_capacity, in)) != -1) {
+        if (line[0] == '#') {
+            unsigned long long size, ino;
+            long long sec, nsec;
+            if (sscanf(line, "#input %llu %llu %lld %lld", &size, &ino, &sec, &nsec) == 4) {
+                builder->identity.input_size = size;
+                builder->identity.input_ino = ino;
+                builder->identity.input_mtime_sec = sec;
+                builder->identity.input_mtime_nsec = nsec;
+                builder->has_identity = 1;
+            }
+            continue;
+        }
+
+        char * p = strchr(line, ' ');
+        if (!p) {
+            continue;
+        }
+        int term_len = p - line;
+        while (*p == ' ') {
+            char * next;
+            uint64_t offset = strtoull(p + 1, &next, 10);
+            if (next == p + 1) {
+                break;
+            }
+            if (line_index_builder_add(builder, line, term_len, offset) < 0) {
+                ret = -1;
+                break;
+            }
+            p = next;
+        }
+    }
+
+    free(line);
+    fclose(in);
+    return ret;
+}
+
+/* Write the builder as an index file.
+   @ret: 0 on success, -1 on error.
+ */
+int line_index_builder_write_index(LINE_INDEX_BUILDER * builder, int fd_out)
+{
+    TERM_ENTRY ** sorted = malloc((builder->count ? builder->count : 1) * sizeof(TERM_ENTRY *));
+    LINE_INDEX_TERM * table = calloc(builder->count ? builder->count : 1, sizeof(LINE_INDEX_TERM));
+    FILE * out = fdopen(dup(fd_out), "w");
+    int ret = -1;
+
+    if (!sorted || !table || !out) {
+        goto done;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < builder->capacity; i++) {
+        if (builder->entries[i].term) {
+            sorted[n++] = &builder->entries[i];
+        }
+    }
+    qsort(sorted, n, sizeof(TERM_ENTRY *), entry_compare);
+
+    uint64_t strings_size = 0;
+    uint64_t postings_size = 0;
+    for (size_t i = 0; i < n; i++) {
+        table[i].string_offset = strings_size;
+        table[i].string_len = sorted[i]->len;
+        table[i].line_num = sorted[i]->line_num;
+        table[i].postings_offset = postings_size;
+        table[i].postings_size = sorted[i]->postings_size;
+        strings_size += sorted[i]->len;
+        postings_size += sorted[i]->postings_size;
+    }
+
+    LINE_INDEX_HEADER header = builder->identity;
+    memcpy(header.magic, LINE_INDEX_MAGIC, sizeof(header.magic));
+    header.term_num = n;
+    header.terms_offset = sizeof(header);
+    header.strings_offset = header.terms_offset + n * sizeof(LINE_INDEX_TERM);
+    header.postings_offset = header.strings_offset + strings_size;
+    header.index_size = header.postings_offset + postings_size;
+
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(table, sizeof(LINE_INDEX_TERM), n, out);
+    for (size_t i = 0; i < n; i++) {
+        fwrite(sorted[i]->term, 1, sorted[i]->len, out);
+    }
+    for (size_t i = 0; i < n; i++) {
+        fwrite(sorted[i]->postings, 1, sorted[i]->postings_size, out);
+    }
+    ret = ferror(out) ? -1 : 0;
+
+done:
+    if (out && fclose(out) != 0) {
+        ret = -1;
+    }
+    free(sorted);
+    free(table);
+    return ret;
+}
+
+/* Copy the line at offset, up to its newline (or a NUL, where the scanning path stops), plus a newline */
+static int copy_line(int fd_input, uint64_t offset, FILE * out)
+{
+    char buf[LINE_CHUNK];
+    while (1) {
+        ssize_t n = pread(fd_input, buf, sizeof(buf), offset);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        char * nl = memchr(buf, '\n', n);
+        char * nul = memchr(buf, '\0', nl ? nl - buf : n);
+        char * stop = nul ? nul : nl;
+        if (stop) {
+            fwrite(buf, 1, stop - buf, out);
+            break;
+        }
+        fwrite(buf, 1, n, out);
+        offset += n;
+    }
+    fputc('\n', out);
+    return 0;
+}
+
+/* Answer a "Word finder" query from an index.
+   The output is what word_finder_map/word_finder_reduce would write: every line containing the
+   word, in file order.
+   @param index_path: The path of the index file.
+   @param input_path: The path of the input file the index was built from.
+   @param word: The word to find.
+   @param fd_out: The file descriptor of the result file.
+   @ret: 0 on success; 1 if the index cannot answer the query, because the word is not purely
+         alphanumeric or the input file changed since the index was built; -1 on error.
+ */
+int line_index_query(const char * index_path, const char * input_path, const char * word, int fd_out)
+{
+    int word_len = strlen(word);
+    if (word_len == 0) {
+        return 1;
+    }
+    for (int i = 0; i < word_len; i++) {
+        if (!isalnum(word[i])) {
+            return 1;
+        }
+    }
+
+    int fd_index = open(index_path, O_RDONLY);
+    if (fd_index < 0) {
+        return 1;
+    }
+    struct stat index_stat;
+    if (fstat(fd_index, &index_stat) < 0 || index_stat.st_size < (off_t)sizeof(LINE_INDEX_HEADER)) {
+        close(fd_index);
+        return 1;
+    }
+    const char * base = mmap(NULL, index_stat.st_size, PROT_READ, MAP_SHARED, fd_index, 0);
+    close(fd_index);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+
+    const LINE_INDEX_HEADER * header = (const LINE_INDEX_HEADER *)base;
+    int fd_input = open(input_path, O_RDONLY);
+    struct stat input_stat;
+    int ret = 1;
+
+    if (fd_input < 0 || fstat(fd_input, &input_stat) < 0 ||
+        memcmp(header->magic, LINE_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->index_size != (uint64_t)index_stat.st_size ||
+        header->input_size != (uint64_t)input_stat.st_size || header->input_ino != (uint64_t)input_stat.st_ino ||
+        header->input_mtime_sec != input_stat.st_mtim.tv_sec || header->input_mtime_nsec != input_stat.st_mtim.tv_nsec) {
+        goto done;
+    }
+
+    /* The sections come in order and the term table is aligned; a damaged index is an error */
+    uint64_t index_size = index_stat.st_size;
+    if (header->terms_offset < sizeof(LINE_INDEX_HEADER) || header->terms_offset % sizeof(uint64_t) != 0 ||
+        header->terms_offset > header->strings_offset || header->strings_offset > header->postings_offset ||
+        header->postings_offset > index_size ||
+        header->term_num > (header->strings_offset - header->terms_offset) / sizeof(LINE_INDEX_TERM)) {
+        ret = -1;
+        goto done;
+    }
+    uint64_t strings_size = header->postings_offset - header->strings_offset;
+    uint64_t postings_size = index_size - header->postings_offset;
+
+    const LINE_INDEX_TERM * table = (const LINE_INDEX_TERM *)(base + header->terms_offset);
+    const char * strings = base + header->strings_offset;
+    const unsigned char * postings = (const unsigned char *)base + header->postings_offset;
+
+    FILE * out = fdopen(dup(fd_out), "w");
+    if (!out) {
+        ret = -1;
+        goto done;
+    }
+    ret = 0;
+
+    size_t low = 0;
+    size_t high = header->term_num;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (table[mid].string_offset > strings_size || table[mid].string_len > strings_size - table[mid].string_offset ||
+            table[mid].postings_offset > postings_size || table[mid].postings_size > postings_size - table[mid].postings_offset) {
+            ret = -1;
+            break;
+        }
+        int c = term_compare(strings + table[mid].string_offset, table[mid].string_len, word, word_len);
+        if (c == 0) {
+            const unsigned char * p = postings + table[mid].postings_offset;
+            const unsigned char * end = p + table[mid].postings_size;
+            uint64_t offset = 0;
+            while (p < end && ret == 0) {
+                uint64_t delta;
+                size_t n = get_varint(p, end, &delta);
+                if (n == 0) {
+                    ret = -1;
+                    break;
+                }
+                p += n;
+                offset += delta;
+                ret = copy_line(fd_input, offset, out);
+            }
+            break;
+        }
+        if (c < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if (fclose(out) != 0) {
+        ret = -1;
+    }
+
+done:
+    if (fd_input >= 0) {
+        close(fd_input);
+    }
+    munmap((void *)base, index_stat.st_size);
+    return ret;
+}
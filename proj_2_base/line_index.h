@@ -0,0 +1,75 @@
+/* The inverted line index of an input file.
+   The index maps every word (a maximal run of alphanumeric characters) to the offsets of the
+   lines that contain it. It is built by a MapReduce job (line_indexer_map/line_indexer_reduce),
+   and a "Word finder" query for an alphanumeric word becomes a lookup plus one pread() per
+   matching line, with the same output as scanning the whole file.
+
+   On disk: a LINE_INDEX_HEADER, the term table sorted by term, the term strings, and the
+   postings. The postings of a term are its line offsets in increasing order, each stored as
+   the unsigned LEB128 varint of its distance from the previous one. The file is used in place
+   through mmap(). */
+
+#ifndef _LINE_INDEX_H
+#define _LINE_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LINE_INDEX_MAGIC "MRLIDX01"
+
+typedef struct _line_index_header
+{
+    char magic[8]; /* LINE_INDEX_MAGIC */
+    uint64_t input_size; /* With input_ino and input_mtime_*, identifies the indexed version of the input file */
+    uint64_t input_ino;
+    int64_t input_mtime_sec;
+    int64_t input_mtime_nsec;
+    uint64_t term_num; /* The number of entries in the term table */
+    uint64_t terms_offset; /* The file offset of the term table */
+    uint64_t strings_offset; /* The file offset of the term strings */
+    uint64_t postings_offset; /* The file offset of the postings */
+    uint64_t index_size; /* The size of the whole index file */
+}LINE_INDEX_HEADER;
+
+typedef struct _line_index_term
+{
+    uint64_t string_offset; /* The offset of the term in the strings section */
+    uint32_t string_len; /* The length of the term */
+    uint32_t line_num; /* The number of lines that contain the term */
+    uint64_t postings_offset; /* The offset of the term's postings in the postings section */
+    uint64_t postings_size; /* The size in bytes of the term's postings */
+}LINE_INDEX_TERM;
+
+/* A term and its postings while the index is being built */
+typedef struct _term_entry
+{
+    char * term;
+    int len;
+    unsigned char * postings; /* Varint-encoded offset deltas */
+    size_t postings_size;
+    size_t postings_capacity;
+    uint32_t line_num;
+    uint64_t last_offset; /* The offset of the last line added */
+}TERM_ENTRY;
+
+/* A hash table of terms, used by both the map and the reduce side of the indexer */
+typedef struct _line_index_builder
+{
+    TERM_ENTRY * entries; /* Open addressing; an entry with term == NULL is free */
+    size_t capacity; /* A power of two */
+    size_t count;
+    LINE_INDEX_HEADER identity; /* Only the input_* fields are used */
+    int has_identity;
+}LINE_INDEX_BUILDER;
+
+int line_index_builder_init(LINE_INDEX_BUILDER * builder);
+void line_index_builder_free(LINE_INDEX_BUILDER * builder);
+int line_index_builder_add(LINE_INDEX_BUILDER * builder, const char * term, int len, uint64_t line_offset);
+int line_index_builder_identify(LINE_INDEX_BUILDER * builder, int fd_input);
+int line_index_builder_write_text(LINE_INDEX_BUILDER * builder, int fd_out);
+int line_index_builder_read_text(LINE_INDEX_BUILDER * builder, int fd_in);
+int line_index_builder_write_index(LINE_INDEX_BUILDER * builder, int fd_out);
+
+int line_index_query(const char * index_path, const char * input_path, const char * word, int fd_out);
+
+#endif
@@ -1,12 +1,21 @@
-/* The implemetation of the test driver program. Don't change this file */
+/* The test driver program: runs a job from the command line, or serves jobs and submits them to a job server */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 #include "mapreduce.h"
 #include "usr_functions.h"
+#include "frame_index.h"
+#include "line_index.h"
+#include "job_server.h"
+
+// options come before the positional arguments, so a word to find may start with '-'
+#define JOB_OPTIONS "+zC:R:T:I:a:s:e:r:o:w:"
 
 int str_is_decimal_num(char * str)
 {
@@ -51,29 +60,206 @@ int is_regular_file(char * file_path)
     return 0;
 }
 
+int is_directory(char * file_path)
+{
+    struct stat file_stat;
+
+    if (-1 == stat(file_path, &file_stat))
+    {
+        return 0;
+    }
+
+    return S_ISDIR(file_stat.st_mode);
+}
+
+// every entry of the comma-separated input list must be a regular file, a directory or a glob pattern
+int is_valid_input(char * input)
+{
+    char * list = strdup(input);
+    char * save = NULL;
+    char * entry = NULL;
+    int ret = 1;
+
+    for (entry = strtok_r(list, ",", &save); entry; entry = strtok_r(NULL, ",", &save))
+    {
+        if (!strpbrk(entry, "*?[") && !is_regular_file(entry) && !is_directory(entry))
+        {
+            printf("Regular file or directory %s does not exist.\n", entry);
+            ret = 0;
+            break;
+        }
+    }
+
+    free(list);
+    return ret;
+}
+
+// the line indexer records file offsets, so its input must be one uncompressed file
+int is_plain_file(char * file_path)
+{
+    int fd = -1, format = INPUT_PLAIN;
+
+    if (strpbrk(file_path, ",*?[") || !is_regular_file(file_path))
+    {
+        return 0;
+    }
+
+    fd = open(file_path, O_RDONLY);
+    if (-1 == fd)
+    {
+        return 0;
+    }
+    format = frame_detect_format(fd);
+    close(fd);
+
+    return INPUT_PLAIN == format;
+}
+
 void print_usage(char * cmd_name)
 {
-    printf("Usage: %s \"counter\"|\"finder\" file_path split_num [word_to_find]\n", cmd_name);
+    printf("Usage: %s [-z] [-C cache_dir] [-R attempts] [-T straggler_ms] [-I index] [-a rr|cpu_list] [-s fraction] [-e error] [-r seed] [-o output] [-w scratch_root] \"counter\"|\"finder\"|\"finder-count\"|\"indexer\" input split_num [word_to_find]\n", cmd_name);
+    printf("  -z  block-compress the intermediate data files\n");
+    printf("  -C  reuse the intermediate data of unchanged input chunks cached in cache_dir\n");
+    printf("  -R  try a failing map split up to this many times (default 1)\n");
+    printf("  -T  launch a duplicate of a map split still running after this many milliseconds\n");
+    printf("  -a  pin each map worker to a CPU (round-robin, or from a list such as 0-3,8)\n");
+    printf("      and allocate its memory on that CPU's NUMA node\n");
+    printf("  -I  \"indexer\" writes a line index of input to this file; \"finder\" answers from it\n");
+    printf("      while input is unchanged, and scans input otherwise\n");
+    printf("  -s  \"counter\" and \"finder-count\" only: map this fraction of the input, in random chunks,\n");
+    printf("      and write estimates with 95%% confidence intervals\n");
+    printf("  -e  sample until every estimate is within this relative error (with -s, at most that fraction);\n");
+    printf("      keys under 1%% of the total are held to this error of 1%% of the total\n");
+    printf("  -r  the seed choosing the sampled chunks (default 1)\n");
+    printf("  -o  write the result file here (default mr.rst); it is replaced only once complete\n");
+    printf("  -w  keep the intermediate data in a new directory under scratch_root (default: $TMPDIR or /tmp)\n");
+    printf("Usage: %s -S socket [-j slots]\n", cmd_name);
+    printf("  serve jobs on a Unix domain socket, running jobs together while their map workers fit in\n");
+    printf("  slots (default: the number of CPUs), and taking waiting jobs of different login sessions in turn\n");
+    printf("Usage: %s -c socket [options] \"counter\"|\"finder\"|\"finder-count\"|\"indexer\" input split_num [word_to_find]\n", cmd_name);
+    printf("  run a job on the server at socket; its result file is written here, to output\n");
+    printf("  input is a comma-separated list of files, directories and quoted glob patterns;\n");
+    printf("  each file may be plain text, multi-member gzip (e.g. bgzip) or multi-frame zstd\n");
 }
 
 
-int main(int argc, char * argv[])
+// the number of map workers a job asks for, read from its arguments the way run_job() reads them
+int job_slots(int argc, char * argv[])
+{
+    int split_num = 1;
+
+    optind = 0; // start over; glibc also resets its other getopt state
+    opterr = 0;
+    while (getopt(argc, argv, JOB_OPTIONS) != -1)
+    {
+    }
+    opterr = 1;
+
+    if (argc - optind >= 3 && str_is_decimal_num(argv[optind + 2]) && atoi(argv[optind + 2]) > 0)
+    {
+        split_num = atoi(argv[optind + 2]);
+    }
+
+    return split_num;
+}
+
+// the result file a job's arguments ask for, read the way run_job() reads them
+char * job_output(int argc, char * argv[])
 {
-    int i = 0, is_letter_counter = 0;
+    char * output = "mr.rst";
+    int opt = 0;
+
+    optind = 0;
+    opterr = 0;
+    while ((opt = getopt(argc, argv, JOB_OPTIONS)) != -1)
+    {
+        if ('o' == opt)
+        {
+            output = optarg;
+        }
+    }
+    opterr = 1;
+
+    return output;
+}
+
+/* Run one job from its command line. The server passes work_dir, the job's own directory, where
+   the result file is left as mr.rst for the server to send back and the scratch data goes by default. */
+int run_job(int argc, char * argv[], const char * work_dir)
+{
+    int i = 0, is_letter_counter = 0, is_line_indexer = 0, is_match_counter = 0, opt = 0, ret = 0;
+    char * cmd_name = argv[0];
+    char * index_path = NULL;
+    char * output_name = "mr.rst";
+    char result_name[4096 + 256];
+    char output_path[4096];
+    char output_temp[4096 + 32];
+    struct timeval start, end;
     
     MAPREDUCE_SPEC spec;
     MAPREDUCE_RESULT result;
 
-    setbuf(stdout, NULL); // no bufferring for stdio
+    memset(&spec, 0, sizeof(spec));
+    memset(&result, 0, sizeof(result));
+    spec.sample_seed = 1;
+
+    optind = 0;
+    while ((opt = getopt(argc, argv, JOB_OPTIONS)) != -1)
+    {
+        switch (opt)
+        {
+        case 'z':
+            spec.compress_intermediate = 1;
+            break;
+        case 'C':
+            spec.cache_dir = optarg;
+            break;
+        case 'R':
+            spec.max_attempts = atoi(optarg);
+            break;
+        case 'T':
+            spec.straggler_ms = atoi(optarg);
+            break;
+        case 'a':
+            spec.cpu_affinity = optarg;
+            break;
+        case 'I':
+            index_path = optarg;
+            break;
+        case 's':
+            spec.sample_fraction = atof(optarg);
+            break;
+        case 'e':
+            spec.sample_error = atof(optarg);
+            break;
+        case 'r':
+            spec.sample_seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            output_name = optarg;
+            break;
+        case 'w':
+            spec.scratch_root = optarg;
+            break;
+        default:
+            print_usage(cmd_name);
+            exit(1);
+        }
+    }
+
+    // shift the positional arguments so that argv[1] is the task name
+    argv += optind - 1;
+    argc -= optind - 1;
 
     if (argc < 4)
     {
-        print_usage(argv[0]);
+        print_usage(cmd_name);
         exit(1);
     }
 
-    /* argv[1] must be either "counter", meaning the "Letter counter" task,
-       or "finder", meaning the "Word finder" task*/
+    /* argv[1] must be either "counter", meaning the "Letter counter" task, "finder", meaning the
+       "Word finder" task, "finder-count", meaning the "Match counter" task, or "indexer", meaning
+       the "Line indexer" task*/
     if (!strcmp(argv[1], "counter"))
     {
         is_letter_counter = 1;
@@ -83,20 +269,37 @@ int main(int argc, char * argv[])
         is_letter_counter = 0;
         if (argc < 5) // there must be a argv[4], which is the word to find
         {
-            print_usage(argv[0]);
+            print_usage(cmd_name);
+            exit(1);
+        }
+    }
+    else if (!strcmp(argv[1], "finder-count"))
+    {
+        is_match_counter = 1;
+        if (argc < 5) // there must be a argv[4], which is the word to count
+        {
+            print_usage(cmd_name);
+            exit(1);
+        }
+    }
+    else if (!strcmp(argv[1], "indexer"))
+    {
+        is_line_indexer = 1;
+        if (NULL == index_path)
+        {
+            print_usage(cmd_name);
             exit(1);
         }
     }
     else
     {
-        print_usage(argv[0]);
+        print_usage(cmd_name);
         exit(1);
     }
 
-    // argv[2] is the input data file
-    if (!is_regular_file(argv[2]))
+    // argv[2] is the input data
+    if (!is_valid_input(argv[2]))
     {
-        printf("Regular file %s does not exist.\n", argv[2]);
         exit(0);
     }
 
@@ -108,15 +311,123 @@ int main(int argc, char * argv[])
     }
 
 
-    spec.input_data_filepath = argv[2]; // argv[2] is the input data file
+    // only sums can be estimated from a sample
+    if ((spec.sample_fraction > 0 || spec.sample_error > 0) && !is_letter_counter && !is_match_counter)
+    {
+        printf("Only \"counter\" and \"finder-count\" can be sampled.\n");
+        exit(0);
+    }
+
+    if (spec.sample_fraction < 0 || spec.sample_fraction > 1 || spec.sample_error < 0)
+    {
+        printf("The sampling fraction must be in [0, 1] and the error bound positive.\n");
+        exit(0);
+    }
+
+    if (is_line_indexer && !is_plain_file(argv[2]))
+    {
+        printf("The line indexer needs a single uncompressed input file.\n");
+        exit(0);
+    }
+
+    // the cache keys map output by content, but index map output holds file offsets
+    if (is_line_indexer && spec.cache_dir)
+    {
+        printf("The line indexer does not use the cache; ignoring -C.\n");
+        spec.cache_dir = NULL;
+    }
+
+    // the index is the result file of the "Line indexer" task; a server job leaves its result in work_dir
+    if (is_line_indexer)
+    {
+        output_name = index_path;
+    }
+    snprintf(output_path, sizeof(output_path), "%s", output_name);
+    if (work_dir)
+    {
+        if (!is_line_indexer)
+        {
+            snprintf(output_path, sizeof(output_path), "%s/mr.rst", work_dir);
+        }
+        if (NULL == spec.scratch_root)
+        {
+            spec.scratch_root = (char *)work_dir;
+        }
+    }
+    spec.output_filepath = output_path;
+
+    // the result file is reported as the user will find it: a server job's client writes it in its own directory
+    snprintf(result_name, sizeof(result_name), "%s", output_name);
+    if (work_dir && '/' != output_name[0])
+    {
+        char cwd[4096];
+        if (NULL != getcwd(cwd, sizeof(cwd)))
+        {
+            snprintf(result_name, sizeof(result_name), "%s/%s", cwd, output_name);
+        }
+    }
+
+    // answer the "Word finder" task from the index when it is up to date
+    if (!is_letter_counter && !is_line_indexer && !is_match_counter && index_path)
+    {
+        snprintf(output_temp, sizeof(output_temp), "%s.%d.tmp", output_path, getpid());
+        int fd_out = open(output_temp, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+        if (-1 == fd_out)
+        {
+            printf("Failed to create the result file!\n");
+            exit(2);
+        }
+
+        gettimeofday(&start, NULL);
+        ret = line_index_query(index_path, argv[2], argv[4], fd_out);
+        gettimeofday(&end, NULL);
+        close(fd_out);
+
+        if (0 == ret && -1 == rename(output_temp, output_path))
+        {
+            ret = -1;
+        }
+        unlink(output_temp);
+
+        if (0 == ret)
+        {
+            printf("***** RESULT ***** \n");
+            printf("Result file: %s\n", result_name);
+            printf("Answered from index: %s\n", index_path);
+            printf("Processing time (us): %ld\n", (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec));
+            exit(0);
+        }
+        if (-1 == ret)
+        {
+            printf("Failed to read index %s!\n", index_path);
+            exit(2);
+        }
+        printf("Index %s cannot answer this query; scanning the input.\n", index_path);
+    }
+
+    spec.input_data_filepath = argv[2]; // argv[2] is the input data
     spec.split_num = atoi(argv[3]); // argv[3] is the number of the splits
 
+    spec.job_name = argv[1];
+
     if (is_letter_counter)
     {
         spec.map_func = letter_counter_map;
         spec.reduce_func = letter_counter_reduce;
         spec.usr_data = NULL;
     }
+    else if (is_match_counter)
+    {
+        spec.map_func = match_counter_map;
+        spec.reduce_func = match_counter_reduce;
+        spec.usr_data = argv[4]; // argv[4] is the word to count
+    }
+    else if (is_line_indexer)
+    {
+        spec.map_func = line_indexer_map;
+        spec.reduce_func = line_indexer_reduce;
+        spec.usr_data = NULL;
+    }
     else
     {
         spec.map_func = word_finder_map;
@@ -124,7 +435,6 @@ int main(int argc, char * argv[])
         spec.usr_data = argv[4]; // argv[4] is the word to find
     }
 
-    result.filepath = "mr.rst"; // name of the output file (placed in the working directory)
     result.map_worker_pid = malloc(spec.split_num * sizeof(*result.map_worker_pid));
 	if (NULL == result.map_worker_pid)
 	{
@@ -136,15 +446,84 @@ int main(int argc, char * argv[])
 
     // print the result
     printf("***** RESULT ***** \n");
-    printf("Result file: %s\n", result.filepath);
+    printf("Result file: %s\n", result_name);
     
     printf("Map worker pids: "); 
     for (i = 0; i < spec.split_num; i++) printf("%d ", result.map_worker_pid[i]); 
     printf("\n");
 
     printf("Reduce worker pid: %d\n", result.reduce_worker_pid);
+    printf("Map attempts: %d (%d failed, %d speculative)\n", result.map_attempts, result.map_failures, result.speculative_attempts);
     printf("Processing time (us): %d\n", result.processing_time);
+
+    if (spec.cpu_affinity)
+    {
+        int local = 0, known = 0;
+        printf("Map worker placement (split:cpu/node/input node): ");
+        for (i = 0; i < spec.split_num; i++)
+        {
+            printf("%d:%d/%d/%d ", i, result.map_worker_cpu[i], result.map_worker_node[i], result.map_input_node[i]);
+            if (result.map_input_node[i] >= 0)
+            {
+                known += 1;
+                local += result.map_input_node[i] == result.map_worker_node[i];
+            }
+        }
+        printf("\n");
+        printf("Splits with node-local input: %d of %d\n", local, known);
+    }
+
+    if (result.total_chunks > 0)
+    {
+        printf("Sampled chunks: %d of %d (seed %u)\n", result.sampled_chunks, result.total_chunks, spec.sample_seed);
+        printf("Largest relative error (95%% interval, rare keys against 1%% of the total): %.4f\n", result.sample_error);
+    }
+
+    if (spec.cache_dir)
+    {
+        printf("Cache hits: %d, misses: %d\n", result.cache_hits, result.cache_misses);
+    }
+
+    printf("Intermediate data (bytes): %ld raw, %ld stored\n", result.intermediate_raw_bytes, result.intermediate_stored_bytes);
+    if (spec.compress_intermediate)
+    {
+        printf("Compression ratio: %.2f\n", result.intermediate_stored_bytes > 0 ?
+               (double)result.intermediate_raw_bytes / result.intermediate_stored_bytes : 0.0);
+        printf("Codec time (us): %d\n", result.codec_time);
+    }
     
     exit(0);
 }
 
+int main(int argc, char * argv[])
+{
+    int slots = 0;
+
+    setbuf(stdout, NULL); // no bufferring for stdio
+
+    // the server and client modes are chosen by the first argument
+    if (argc >= 3 && !strcmp(argv[1], "-S"))
+    {
+        slots = sysconf(_SC_NPROCESSORS_ONLN);
+        if (argc >= 5 && !strcmp(argv[3], "-j") && str_is_decimal_num(argv[4]))
+        {
+            slots = atoi(argv[4]);
+        }
+        else if (argc != 3)
+        {
+            print_usage(argv[0]);
+            exit(1);
+        }
+        exit(job_server_run(argv[2], slots, run_job, job_slots) < 0 ? 2 : 0);
+    }
+
+    if (argc >= 3 && !strcmp(argv[1], "-c"))
+    {
+        // the job's command line is argv without "-c socket"
+        char * socket_path = argv[2];
+        argv[2] = argv[0];
+        exit(job_client_run(socket_path, argc - 2, argv + 2, job_output(argc - 2, argv + 2)));
+    }
+
+    return run_job(argc, argv, NULL);
+}
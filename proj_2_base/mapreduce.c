@@ -1,6 +1,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <sys/time.h>
 #include "mapreduce.h"
@@ -8,184 +9,882 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <string.h>
+#include <math.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "codec.h"
+#include "split_plan.h"
+#include "split_cache.h"
+#include "placement.h"
+#include "sampling.h"
+
+
+/* What a map worker and the reduce worker report back about split i, through shared memory */
+typedef struct _worker_stats
+{
+    CODEC_STATS compress; /* The compressor of the split's intermediate data */
+    CODEC_STATS decompress; /* The decompressor feeding the split's intermediate data to the reducer */
+    int cache_hits; /* The number of pieces found in the split result cache */
+    int cache_misses; /* The number of pieces mapped and added to the cache */
+    int cpu; /* The CPU the map worker finished on */
+    int node; /* The NUMA node of that CPU */
+    int input_node; /* The node holding most of the split's input in the page cache after mapping, or -1 */
+}WORKER_STATS;
+
+/* One attempt at mapping a split */
+typedef struct _map_attempt
+{
+    pid_t pid; /* The process ID of the map worker, or 0 once it has been reaped */
+    int split; /* The split being mapped */
+    int attempt; /* The attempt number within the split, counting from 0 */
+    int killed; /* Set when another attempt of the split won */
+    struct timeval start; /* When the attempt was launched */
+}MAP_ATTEMPT;
+
+typedef struct _split_state
+{
+    int launched; /* The number of attempts launched, the speculative one included */
+    int failed; /* The number of attempts that failed */
+    int running; /* The number of attempts still running */
+    int speculated; /* Set once a speculative duplicate has been launched */
+    int winner; /* The attempt whose output was committed, or -1 while the split is pending */
+}SPLIT_STATE;
+
+/* The map phase: every split is retried up to spec->max_attempts times, and a straggler gets
+   one speculative duplicate. The first attempt to finish commits its output. */
+typedef struct _map_phase
+{
+    MAPREDUCE_SPEC * spec;
+    SPLIT_PLAN * plan;
+    int use_cache; /* Whether the pieces go through the split result cache */
+    int sampling; /* Whether each piece's output is preceded by a SAMPLE_PIECE_MARK line */
+    const char * scratch_dir; /* The job's scratch directory, holding its intermediate files */
+    PLACEMENT * placement; /* The CPU slots of the map workers, or NULL if they are not pinned */
+    int * split_slots; /* With placement: the slot of every split's first attempt */
+    int max_attempts; /* The number of non-speculative attempts a split may take */
+    int attempt_slots; /* The most attempts a split may take: max_attempts plus the speculative one */
+    WORKER_STATS * worker_stats; /* attempt_slots entries per split, in shared memory */
+    SPLIT_STATE * splits; /* One entry per split */
+    MAP_ATTEMPT * attempts; /* Every attempt launched so far */
+    int attempt_num;
+    int attempt_capacity;
+}MAP_PHASE;
+
+#define STRAGGLER_POLL_US 10000 /* How often stragglers are looked for */
+#define SAMPLE_ROUND_MARGIN 1.1 /* How much larger than predicted the next sampling round is made */
+#define SAMPLE_ROUND_GROWTH_MAX 8 /* The most a sample grows from one round to the next */
+#define SCRATCH_PATH_SIZE 1024 /* The size of the buffers holding paths in the scratch directory */
+
+/* The scratch directory and the unpublished result file of the running job, removed by
+   remove_scratch() however the job ends, since errors exit() from deep inside the job */
+static char scratch_dir[SCRATCH_PATH_SIZE - 32]; /* Leaving room for the names of the files in it */
+static char result_temp[SCRATCH_PATH_SIZE];
+static pid_t scratch_owner;
+
+
+/* Open an intermediate data file for a map function, through a compressor if the job asks for one.
+   @ret: The file descriptor to write to, or -1 on error. Release it with close_map_output().
+ */
+static int open_map_output(MAPREDUCE_SPEC * spec, const char * path, CODEC_STATS * stats, pid_t * p_codec_pid)
+{
+    int fd_out = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0666);
 
+    *p_codec_pid = -1;
+    if (fd_out < 0 || !spec->compress_intermediate) {
+        return fd_out;
+    }
 
-void mapreduce(MAPREDUCE_SPEC * spec, MAPREDUCE_RESULT * result)
+    int fd_codec = codec_start_writer(fd_out, stats, p_codec_pid);
+    close(fd_out);
+    return fd_codec;
+}
+
+static int close_map_output(int fd_out, pid_t codec_pid)
 {
-    if (spec == NULL || result == NULL || spec->split_num <= 0 || spec->input_data_filepath == NULL) {
-        EXIT_ERROR(ERROR, "Invalid specifications\n");
+    close(fd_out);
+    if (codec_pid > 0 && codec_wait(codec_pid) < 0) {
+        return -1;
     }
+    return 0;
+}
 
-    int input_fd = open(spec->input_data_filepath, O_RDONLY);
-    if (input_fd < 0) {
-        EXIT_ERROR(ERROR, "Failed to open input file\n");
+static WORKER_STATS * attempt_stats(MAP_PHASE * phase, int split, int attempt)
+{
+    return &phase->worker_stats[split * phase->attempt_slots + attempt];
+}
+
+/* An attempt writes to its own temporary file, renamed to the intermediate file only if it wins */
+static void attempt_path(MAP_PHASE * phase, char * path, size_t size, int split, int attempt)
+{
+    snprintf(path, size, "%s/mr-%d.itm.%d.tmp", phase->scratch_dir, split, attempt);
+}
+
+/* Remove the job's scratch directory and unpublished result; an atexit() handler */
+static void remove_scratch(void)
+{
+    /* Map workers and codec processes are forked from the job and exit too */
+    if (scratch_owner != getpid()) {
+        return;
     }
 
-    int file_size = lseek(input_fd, 0, SEEK_END);
-    lseek(input_fd, 0, SEEK_SET);
+    if (result_temp[0]) {
+        unlink(result_temp);
+        result_temp[0] = '\0';
+    }
 
-    if (file_size <= 0) {
-        close(input_fd);
-        EXIT_ERROR(ERROR, "Invalid or empty input file\n");
+    if (scratch_dir[0]) {
+        DIR * dir = opendir(scratch_dir);
+        if (dir) {
+            struct dirent * entry;
+            while ((entry = readdir(dir))) {
+                char path[SCRATCH_PATH_SIZE + 256];
+                if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
+                    snprintf(path, sizeof(path), "%s/%s", scratch_dir, entry->d_name);
+                    unlink(path);
+                }
+            }
+            closedir(dir);
+        }
+        rmdir(scratch_dir);
+        scratch_dir[0] = '\0';
     }
+}
 
-    int split_num = spec->split_num;
+/* Failure and delay injection, for testing the retry and speculation paths.
+   MR_INJECT_FAIL="split[.attempt],..." makes the listed attempts fail after writing their output;
+   MR_INJECT_DELAY="split[.attempt]:ms,..." makes them sleep before mapping. The attempt defaults to 0.
+   @ret: 1 if the attempt is listed in the environment variable name, 0 otherwise.
+ */
+static int injected(const char * name, int split, int attempt, long * p_value)
+{
+    const char * p = getenv(name);
+    while (p && *p) {
+        char * q;
+        long s = strtol(p, &q, 10);
+        long a = 0;
+        long value = 0;
+        if (*q == '.') {
+            a = strtol(q + 1, &q, 10);
+        }
+        if (*q == ':') {
+            value = strtol(q + 1, &q, 10);
+        }
+        if (s == split && a == attempt) {
+            if (p_value) {
+                *p_value = value;
+            }
+            return 1;
+        }
+        p = strchr(q, ',');
+        if (p) {
+            p++;
+        }
+    }
+    return 0;
+}
 
-    result->map_worker_pid = malloc(split_num * sizeof(int));
-    if (!result->map_worker_pid) {
-        close(input_fd);
-        EXIT_ERROR(ERROR, "Failed to allocate memory for worker PIDs\n");
+/* Run the map function over one piece of the input */
+static void map_piece(MAPREDUCE_SPEC * spec, SPLIT_PLAN * plan, SPLIT_PIECE * piece, int fd_out)
+{
+    long piece_size;
+    int worker_fd = split_piece_open(plan, piece, &piece_size);
+    if (worker_fd < 0) {
+        EXIT_ERROR(ERROR, "Failed to open input split\n");
+    }
+    /* The plan cuts pieces at SPLIT_PIECE_MAX, but a single line or frame may still be longer */
+    if (piece_size > INT_MAX) {
+        EXIT_ERROR(ERROR, "An input piece of %ld bytes is too large for the map function\n", piece_size);
     }
 
-    char intermediate_files[split_num][256];
-    for (int i = 0; i < split_num; i++) {
-        snprintf(intermediate_files[i], sizeof(intermediate_files[i]), "mr-%d.itm", i);
+    DATA_SPLIT split = {
+        .fd = worker_fd,
+        .size = piece_size,
+        .usr_data = spec->usr_data
+    };
+
+    if (spec->map_func(&split, fd_out) < 0) {
+        EXIT_ERROR(ERROR, "Map function failed\n");
     }
-    
-    struct timeval start, end;
 
-    if (NULL == spec || NULL == result)
-    {
-        EXIT_ERROR(ERROR, "NULL pointer!\n");
+    close(worker_fd);
+}
+
+/* Produce the intermediate data of one piece through the split result cache.
+   A missing entry is mapped into a temporary file and renamed into place, so a concurrent
+   or crashed job never leaves a partial entry behind. The entry is then appended to fd_out.
+ */
+static void map_piece_cached(MAPREDUCE_SPEC * spec, SPLIT_PLAN * plan, SPLIT_PIECE * piece, int fd_out, WORKER_STATS * stats)
+{
+    char entry[4096];
+    if (split_cache_entry(plan, piece, spec, entry, sizeof(entry)) < 0) {
+        EXIT_ERROR(ERROR, "Failed to compute the cache key of an input split\n");
     }
-    
-    gettimeofday(&start, NULL);
 
-    // printf("file size %d\n", file_size);
-
-    int split_size = file_size / split_num;
-    // printf("split_size %d\n", split_size);
-    int current_offset = 0;
-    int current_offset_array[split_num];
-    int adjusted_size_array[split_num];
-
-    for (int i=0; i<split_num; i++){
-        
-        // printf("split_num %d\n", i);
-        // printf("current_offset %d\n", current_offset);
-        int adjusted_size = split_size;
-
-        if (i < split_num - 1) {
-            lseek(input_fd, current_offset + split_size, SEEK_SET);
-
-            char c;
-            while (read(input_fd, &c, 1) > 0) {
-                adjusted_size++;      
-                // if (c == '.' || c == ',' || c == '!') {  
-                if(c == '\n'){
-                    break;
-                }
-            }
-        } else {
-            adjusted_size = file_size - current_offset;
-            if (adjusted_size < 0 ) {
-                adjusted_size = 0;
-            }
+    if (access(entry, R_OK) == 0) {
+        stats->cache_hits++;
+    } else {
+        char temp[4096 + 32];
+        snprintf(temp, sizeof(temp), "%s.%d.tmp", entry, getpid());
+
+        pid_t codec_pid;
+        int fd_entry = open_map_output(spec, temp, &stats->compress, &codec_pid);
+        if (fd_entry < 0) {
+            EXIT_ERROR(ERROR, "Failed to create cache entry\n");
+        }
+        map_piece(spec, plan, piece, fd_entry);
+        if (close_map_output(fd_entry, codec_pid) < 0 || rename(temp, entry) < 0) {
+            unlink(temp);
+            EXIT_ERROR(ERROR, "Failed to store cache entry\n");
         }
+        stats->cache_misses++;
+    }
+
+    if (split_cache_copy(entry, fd_out) < 0) {
+        EXIT_ERROR(ERROR, "Failed to read cache entry\n");
+    }
+}
 
-        current_offset_array[i] = current_offset;
-        adjusted_size_array[i] = adjusted_size;
 
-        // printf("adjusted size %d\n", adjusted_size);
-        // printf("adjusted size + current offset %d\n", current_offset+adjusted_size);
-        current_offset += adjusted_size;
+/* The body of a map worker process; it does not return */
+static void run_map_worker(MAP_PHASE * phase, int split, int attempt)
+{
+    MAPREDUCE_SPEC * spec = phase->spec;
+    SPLIT_PLAN * plan = phase->plan;
+    WORKER_STATS * stats = attempt_stats(phase, split, attempt);
+    char path[SCRATCH_PATH_SIZE];
+    long delay_ms;
+
+    attempt_path(phase, path, sizeof(path), split, attempt);
+
+    /* Pin before anything is allocated, so the worker's buffers and page cache land on its node */
+    if (phase->placement &&
+        placement_apply(phase->placement, placement_attempt_slot(phase->placement, phase->split_slots[split], attempt)) < 0) {
+        EXIT_ERROR(ERROR, "Failed to pin map worker of split %d\n", split);
+    }
 
+    if (injected("MR_INJECT_DELAY", split, attempt, &delay_ms)) {
+        usleep(delay_ms * 1000);
     }
 
-    // for (int i = 0; i < split_num; i++){
-    //     printf("%d %d %d\n", current_offset_array[i], adjusted_size_array[i], current_offset_array[i]+adjusted_size_array[i] );
-    // }
+    int fd_out;
+    pid_t codec_pid = -1;
+    if (phase->use_cache) {
+        /* Cache entries are already compressed when the job asks for it, so they are copied as they are */
+        fd_out = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    } else {
+        fd_out = open_map_output(spec, path, &stats->compress, &codec_pid);
+    }
 
-    for (int i = 0; i < split_num; i++){
+    if (fd_out < 0) {
+        EXIT_ERROR(ERROR, "Failed to create intermediate file\n");
+    }
 
-        pid_t pid = fork();
-        if (pid < 0) {
-            close(input_fd);
-            EXIT_ERROR(ERROR, "Failed to fork map worker process\n");
+    /* The map function runs once per piece; all pieces of the split share one intermediate file */
+    for (int p = plan->piece_bounds[split]; p < plan->piece_bounds[split + 1]; p++) {
+        /* The estimator needs each chunk's output on its own */
+        if (phase->sampling && dprintf(fd_out, SAMPLE_PIECE_MARK " %ld\n", split_piece_weight(plan, &plan->pieces[p])) < 0) {
+            EXIT_ERROR(ERROR, "Failed to write intermediate file\n");
+        }
+        if (phase->use_cache) {
+            map_piece_cached(spec, plan, &plan->pieces[p], fd_out, stats);
+        } else {
+            map_piece(spec, plan, &plan->pieces[p], fd_out);
         }
+    }
 
-        if (pid == 0) {  
-            int fd_out = open(intermediate_files[i], O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (injected("MR_INJECT_FAIL", split, attempt, NULL)) {
+        EXIT_ERROR(ERROR, "Injected failure of split %d, attempt %d\n", split, attempt);
+    }
 
-            if (fd_out < 0) {
-                EXIT_ERROR(ERROR, "Failed to create intermediate file\n");
-            }
+    if (close_map_output(fd_out, codec_pid) < 0) {
+        EXIT_ERROR(ERROR, "Failed to compress intermediate data\n");
+    }
 
-            int worker_fd = dup(input_fd); 
-            lseek(worker_fd, current_offset_array[i], SEEK_SET);
+    if (phase->placement) {
+        placement_current(&stats->cpu, &stats->node);
+        stats->input_node = placement_split_node(plan, split);
+    }
+    exit(0);
+}
 
-            DATA_SPLIT split = {
-                .fd = worker_fd,
-                .size = adjusted_size_array[i],
-                .usr_data = spec->usr_data
-            };
+static void launch_attempt(MAP_PHASE * phase, int split)
+{
+    SPLIT_STATE * state = &phase->splits[split];
 
-            if (spec->map_func(&split, fd_out) < 0) {
-                EXIT_ERROR(ERROR, "Map function failed\n");
-            }
+    if (phase->attempt_num == phase->attempt_capacity) {
+        phase->attempt_capacity = phase->attempt_capacity ? 2 * phase->attempt_capacity : 64;
+        phase->attempts = realloc(phase->attempts, phase->attempt_capacity * sizeof(MAP_ATTEMPT));
+        if (!phase->attempts) {
+            EXIT_ERROR(ERROR, "Failed to allocate memory for map attempts\n");
+        }
+    }
+
+    int attempt = state->launched;
+    pid_t pid = fork();
+    if (pid < 0) {
+        EXIT_ERROR(ERROR, "Failed to fork map worker process\n");
+    }
+
+    if (pid == 0) {
+        /* Its own process group, so that a losing attempt is killed together with its codec process */
+        setpgid(0, 0);
+        run_map_worker(phase, split, attempt);
+    }
+
+    setpgid(pid, pid);
 
-            close(fd_out);
-            close(worker_fd);
-            exit(0);
+    MAP_ATTEMPT * a = &phase->attempts[phase->attempt_num++];
+    a->pid = pid;
+    a->split = split;
+    a->attempt = attempt;
+    a->killed = 0;
+    gettimeofday(&a->start, NULL);
 
+    state->launched++;
+    state->running++;
+}
+
+static void kill_attempts(MAP_PHASE * phase, int split)
+{
+    for (int k = 0; k < phase->attempt_num; k++) {
+        MAP_ATTEMPT * a = &phase->attempts[k];
+        if (a->pid > 0 && (split < 0 || a->split == split) && !a->killed) {
+            kill(-a->pid, SIGKILL);
+            a->killed = 1;
         }
-        else{
+    }
+}
 
-            result->map_worker_pid[i] = pid;
-            int status;
-            waitpid(result->map_worker_pid[i], &status, 0);
-            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
-                close(input_fd);
-                EXIT_ERROR(ERROR, "Map worker process failed\n");
+/* Launch a duplicate of every split whose only attempt has run longer than spec->straggler_ms */
+static void launch_speculative(MAP_PHASE * phase)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    for (int k = 0; k < phase->attempt_num; k++) {
+        MAP_ATTEMPT * a = &phase->attempts[k];
+        SPLIT_STATE * state = &phase->splits[a->split];
+        if (a->pid <= 0 || a->killed || state->winner >= 0 || state->running != 1 || state->speculated) {
+            continue;
+        }
 
+        long elapsed_ms = (now.tv_sec - a->start.tv_sec) * 1000 + (now.tv_usec - a->start.tv_usec) / 1000;
+        if (elapsed_ms > phase->spec->straggler_ms) {
+            DEBUG_MSG("Split %d is a straggler after %ld ms, launching a speculative attempt\n", a->split, elapsed_ms);
+            state->speculated = 1;
+            launch_attempt(phase, a->split);
+        }
+    }
+}
+
+/* Wait for the attempts still running once the phase is over, all of them losers already
+   killed, and remove their temporary files */
+static void reap_attempts(MAP_PHASE * phase)
+{
+    for (int k = 0; k < phase->attempt_num; k++) {
+        MAP_ATTEMPT * a = &phase->attempts[k];
+        if (a->pid > 0) {
+            char path[SCRATCH_PATH_SIZE];
+            waitpid(a->pid, NULL, 0);
+            a->pid = 0;
+            attempt_path(phase, path, sizeof(path), a->split, a->attempt);
+            unlink(path);
+        }
+    }
+}
+
+/* Run all map attempts until every split has committed its intermediate file */
+static void run_map_phase(MAP_PHASE * phase, char (*intermediate_files)[SCRATCH_PATH_SIZE], MAPREDUCE_RESULT * result)
+{
+    MAPREDUCE_SPEC * spec = phase->spec;
+    int split_num = spec->split_num;
+    int pending = split_num;
+
+    for (int i = 0; i < split_num; i++) {
+        launch_attempt(phase, i);
+    }
+
+    while (pending > 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, spec->straggler_ms > 0 ? WNOHANG : 0);
+        if (pid < 0) {
+            kill_attempts(phase, -1);
+            EXIT_ERROR(ERROR, "Failed to wait for map workers\n");
+        }
+        if (pid == 0) {
+            usleep(STRAGGLER_POLL_US);
+            launch_speculative(phase);
+            continue;
+        }
+
+        MAP_ATTEMPT * a = NULL;
+        for (int k = 0; k < phase->attempt_num && !a; k++) {
+            if (phase->attempts[k].pid == pid) {
+                a = &phase->attempts[k];
             }
         }
+        if (!a) {
+            continue;
+        }
+        a->pid = 0;
+
+        SPLIT_STATE * state = &phase->splits[a->split];
+        char path[SCRATCH_PATH_SIZE];
+        attempt_path(phase, path, sizeof(path), a->split, a->attempt);
+        state->running--;
+
+        if (!a->killed && state->winner < 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            /* The first attempt to finish wins; rename() makes its complete output appear at once */
+            if (rename(path, intermediate_files[a->split]) < 0) {
+                kill_attempts(phase, -1);
+                EXIT_ERROR(ERROR, "Failed to commit intermediate file\n");
+            }
+            state->winner = a->attempt;
+            result->map_worker_pid[a->split] = pid;
+            kill_attempts(phase, a->split);
+            pending--;
+            continue;
+        }
+
+        unlink(path);
+        if (a->killed || state->winner >= 0) {
+            continue;
+        }
+
+        state->failed++;
+        if (state->running > 0) {
+            continue; /* The other attempt of the split may still succeed */
+        }
+        if (state->launched - state->speculated >= phase->max_attempts) {
+            kill_attempts(phase, -1);
+            EXIT_ERROR(ERROR, "Map split %d failed after %d attempts\n", a->split, state->launched);
+        }
+        DEBUG_MSG("Map worker of split %d failed, retrying\n", a->split);
+        launch_attempt(phase, a->split);
+    }
+
+    reap_attempts(phase);
+}
+
+
+/* Clear the per-split state of a map phase, to run it again over another plan */
+static void reset_map_phase(MAP_PHASE * phase)
+{
+    int split_num = phase->spec->split_num;
+    for (int i = 0; i < split_num; i++) {
+        memset(&phase->splits[i], 0, sizeof(SPLIT_STATE));
+        phase->splits[i].winner = -1;
     }
+    memset(phase->worker_stats, 0, split_num * phase->attempt_slots * sizeof(WORKER_STATS));
+    phase->attempt_num = 0;
+}
+
+/* Choose the CPU slot of every split; splits whose input is already cached go to CPUs on the node holding it */
+static void place_splits(MAP_PHASE * phase, SPLIT_PLAN * plan)
+{
+    int split_num = phase->spec->split_num;
+    int split_nodes[split_num];
 
-    int intermediate_fds[split_num];
+    if (!phase->placement) {
+        return;
+    }
     for (int i = 0; i < split_num; i++) {
-        intermediate_fds[i] = open(intermediate_files[i], O_RDONLY);
-        if (intermediate_fds[i] < 0) {
+        split_nodes[i] = placement_split_node(plan, i);
+    }
+    placement_assign(phase->placement, split_nodes, split_num, phase->split_slots);
+}
+
+/* Open the intermediate files of a finished map phase and add their sizes to the result */
+static void open_intermediates(MAPREDUCE_SPEC * spec, char (*intermediate_files)[SCRATCH_PATH_SIZE], int * fds, MAPREDUCE_RESULT * result)
+{
+    for (int i = 0; i < spec->split_num; i++) {
+        fds[i] = open(intermediate_files[i], O_RDONLY);
+        if (fds[i] < 0) {
             EXIT_ERROR(ERROR, "Failed to open intermediate file\n");
         }
+
+        struct stat itm_stat;
+        if (fstat(fds[i], &itm_stat) == 0) {
+            result->intermediate_stored_bytes += itm_stat.st_size;
+            if (!spec->compress_intermediate) {
+                result->intermediate_raw_bytes += itm_stat.st_size;
+            }
+        }
     }
+}
 
-    char result_file[] = "mr.rst";
-    int result_fd = open(result_file, O_CREAT | O_WRONLY | O_TRUNC, 0666);
-    if (result_fd < 0) {
-        EXIT_ERROR(ERROR, "Failed to create result file\n");
+/* Add what the attempts of a finished map phase reported to the job's result.
+   With compression, the raw size is counted by the decompressors, so they must have finished. */
+static void add_map_stats(MAP_PHASE * phase, MAPREDUCE_RESULT * result)
+{
+    MAPREDUCE_SPEC * spec = phase->spec;
+
+    result->map_attempts += phase->attempt_num;
+    for (int i = 0; i < spec->split_num; i++) {
+        /* Only the winning attempt's output was used, but every attempt spent codec time */
+        WORKER_STATS * winner = attempt_stats(phase, i, phase->splits[i].winner);
+        if (spec->compress_intermediate) {
+            result->intermediate_raw_bytes += winner->decompress.raw_bytes;
+            result->codec_time += winner->decompress.codec_time;
+            for (int a = 0; a < phase->splits[i].launched; a++) {
+                result->codec_time += attempt_stats(phase, i, a)->compress.codec_time;
+            }
+        }
+        result->cache_hits += winner->cache_hits;
+        result->cache_misses += winner->cache_misses;
+        result->map_failures += phase->splits[i].failed;
+        result->speculative_attempts += phase->splits[i].speculated;
+        if (spec->cpu_affinity) {
+            result->map_worker_cpu[i] = winner->cpu;
+            result->map_worker_node[i] = winner->node;
+            result->map_input_node[i] = winner->input_node;
+        }
     }
+}
 
-    pid_t reduce_pid = fork();
-    if (reduce_pid < 0) {
-        EXIT_ERROR(ERROR, "Failed to fork reduce worker process\n");
+static int int_compare(const void * a, const void * b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/* The number of chunks a sample of sampled chunks with the given error should grow to so as
+   to meet the bound. The half-width goes with sqrt((1 - n / N) / n), so the size is solved for
+   from the error measured so far, with a margin, rather than found by doubling, since each
+   round runs a map phase of its own. */
+static int next_sample_size(int sampled, int chunk_total, double error, double bound)
+{
+    int grown = sampled + sampled / 4;
+    if (!isfinite(error) || error <= 0) {
+        return 2 * sampled;
     }
 
-    if (reduce_pid == 0) {  
-        if (spec->reduce_func(intermediate_fds, split_num, result_fd) < 0) {
-            EXIT_ERROR(ERROR, "Reduce function failed\n");
+    double ratio = bound / error;
+    double inverse = ratio * ratio * (1.0 / sampled - 1.0 / chunk_total) + 1.0 / chunk_total;
+    double size = SAMPLE_ROUND_MARGIN / inverse;
+    /* The error of a small first round is itself rough */
+    if (size > SAMPLE_ROUND_GROWTH_MAX * sampled) {
+        size = SAMPLE_ROUND_GROWTH_MAX * sampled;
+    }
+    if (size > chunk_total) {
+        return chunk_total;
+    }
+    return size > grown ? (int)ceil(size) : grown;
+}
+
+/* Map a random sample of the plan's chunks and write the estimated result to result_fd.
+   Chunks are taken in an order fixed by spec->sample_seed, up to spec->sample_fraction of them.
+   With spec->sample_error, they are mapped in rounds, and sampling stops once the error that
+   sample_max_error() measures is within that bound. After a first round of at least
+   SAMPLE_MIN_CHUNKS, each round grows the sample to the size next_sample_size() solves for:
+   SAMPLE_ROUND_MARGIN (1.1) times what the measured error predicts, at least a quarter more,
+   and at most SAMPLE_ROUND_GROWTH_MAX (8) times the sample so far.
+ */
+static void run_sampling(MAP_PHASE * phase, SPLIT_PLAN * plan, char (*intermediate_files)[SCRATCH_PATH_SIZE],
+                         MAPREDUCE_RESULT * result, int result_fd)
+{
+    MAPREDUCE_SPEC * spec = phase->spec;
+    int split_num = spec->split_num;
+    int chunk_total = plan->piece_num;
+    double fraction = spec->sample_fraction > 0 && spec->sample_fraction < 1 ? spec->sample_fraction : 1;
+    int sample_max = (int)ceil(fraction * chunk_total);
+    if (sample_max < 1) {
+        sample_max = 1;
+    }
+
+    int * order = malloc(chunk_total * sizeof(int));
+    SPLIT_PIECE * pieces = malloc(sample_max * sizeof(SPLIT_PIECE));
+    int bounds[split_num + 1];
+    if (!order || !pieces) {
+        EXIT_ERROR(ERROR, "Failed to allocate memory for sampling\n");
+    }
+    sample_order(order, chunk_total, spec->sample_seed);
+
+    SAMPLE_STATS stats;
+    sample_stats_init(&stats);
+    int sampled = 0;
+    double sample_error = INFINITY;
+
+    while (sampled < sample_max) {
+        int target = sample_max;
+        if (spec->sample_error > 0) {
+            int first_round = split_num > SAMPLE_MIN_CHUNKS ? split_num : SAMPLE_MIN_CHUNKS;
+            target = sampled > 0 ? next_sample_size(sampled, chunk_total, sample_error, spec->sample_error) : first_round;
+            target = target < sample_max ? target : sample_max;
         }
 
-        exit(0);  
-    } else {
-        result->reduce_worker_pid = reduce_pid;
+        /* The round's chunks in file order, for sequential reads, dealt out to the splits in runs */
+        int batch = target - sampled;
+        qsort(order + sampled, batch, sizeof(int), int_compare);
+        for (int k = 0; k < batch; k++) {
+            pieces[k] = plan->pieces[order[sampled + k]];
+        }
+        for (int i = 0; i <= split_num; i++) {
+            bounds[i] = (long)i * batch / split_num;
+        }
+
+        SPLIT_PLAN round = *plan;
+        round.piece_num = batch;
+        round.pieces = pieces;
+        round.piece_bounds = bounds;
+
+        reset_map_phase(phase);
+        phase->plan = &round;
+        place_splits(phase, &round);
+        run_map_phase(phase, intermediate_files, result);
+
+        int intermediate_fds[split_num];
+        open_intermediates(spec, intermediate_files, intermediate_fds, result);
+        for (int i = 0; i < split_num; i++) {
+            pid_t codec_pid = -1;
+            int fd_in = intermediate_fds[i];
+            if (spec->compress_intermediate) {
+                WORKER_STATS * winner = attempt_stats(phase, i, phase->splits[i].winner);
+                fd_in = codec_start_reader(intermediate_fds[i], &winner->decompress, &codec_pid);
+                close(intermediate_fds[i]);
+                if (fd_in < 0) {
+                    EXIT_ERROR(ERROR, "Failed to start the intermediate data decompressor\n");
+                }
+            }
+
+            FILE * in = fdopen(fd_in, "r");
+            if (!in || sample_stats_read(&stats, in) < 0) {
+                EXIT_ERROR(ERROR, "Failed to read intermediate data\n");
+            }
+            fclose(in);
+            if (codec_pid > 0 && codec_wait(codec_pid) < 0) {
+                EXIT_ERROR(ERROR, "Failed to decompress intermediate data\n");
+            }
+        }
+        add_map_stats(phase, result);
+
+        sampled = target;
+        sample_error = sample_max_error(&stats, chunk_total, plan->total_bytes);
+        if (spec->sample_error > 0 && sampled >= SAMPLE_MIN_CHUNKS && sample_error <= spec->sample_error) {
+            break;
+        }
+    }
+
+    if (sample_write(&stats, chunk_total, plan->total_bytes, result_fd) < 0) {
+        EXIT_ERROR(ERROR, "Failed to write result file\n");
+    }
+
+    result->sampled_chunks = sampled;
+    result->total_chunks = chunk_total;
+    result->sample_error = sample_error;
+
+    sample_stats_free(&stats);
+    free(pieces);
+    free(order);
+}
+
+
+void mapreduce(MAPREDUCE_SPEC * spec, MAPREDUCE_RESULT * result)
+{
+    if (spec == NULL || result == NULL || spec->split_num <= 0 || spec->input_data_filepath == NULL) {
+        EXIT_ERROR(ERROR, "Invalid specifications\n");
+    }
+
+    int split_num = spec->split_num;
+
+    result->map_worker_pid = malloc(split_num * sizeof(int));
+    if (!result->map_worker_pid) {
+        EXIT_ERROR(ERROR, "Failed to allocate memory for worker PIDs\n");
+    }
+
+    /* Every job gets its own scratch directory, so that jobs started from one directory do not
+       clobber each other's intermediate files */
+    static int cleanup_registered = 0;
+    if (!cleanup_registered) {
+        atexit(remove_scratch);
+        cleanup_registered = 1;
     }
+    const char * scratch_root = spec->scratch_root ? spec->scratch_root : getenv("TMPDIR");
+    int len = snprintf(scratch_dir, sizeof(scratch_dir), "%s/mr-scratch.XXXXXX", scratch_root ? scratch_root : "/tmp");
+    if (len >= (int)sizeof(scratch_dir) || !mkdtemp(scratch_dir)) {
+        scratch_dir[0] = '\0';
+        EXIT_ERROR(ERROR, "Failed to create a scratch directory under %s\n", scratch_root ? scratch_root : "/tmp");
+    }
+    scratch_owner = getpid();
 
+    char (*intermediate_files)[SCRATCH_PATH_SIZE] = malloc(split_num * sizeof(*intermediate_files));
+    if (!intermediate_files) {
+        EXIT_ERROR(ERROR, "Failed to allocate memory for intermediate file names\n");
+    }
     for (int i = 0; i < split_num; i++) {
-        close(intermediate_fds[i]);
+        snprintf(intermediate_files[i], sizeof(intermediate_files[i]), "%s/mr-%d.itm", scratch_dir, i);
     }
+    
+    struct timeval start, end;
 
-    int status;
-    waitpid(result->reduce_worker_pid, &status, 0);
-    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
-        EXIT_ERROR(ERROR, "Reduce worker process failed\n");
+    if (NULL == spec || NULL == result)
+    {
+        EXIT_ERROR(ERROR, "NULL pointer!\n");
     }
+    
+    /* Sampled runs put chunk markers into the intermediate data, which cached entries do not have */
+    int sampling = spec->sample_fraction > 0 || spec->sample_error > 0;
+    int use_cache = spec->cache_dir != NULL && spec->job_name != NULL && !sampling;
+    if (use_cache && mkdir(spec->cache_dir, 0777) < 0 && access(spec->cache_dir, W_OK) < 0) {
+        EXIT_ERROR(ERROR, "Cache directory %s is not writable\n", spec->cache_dir);
+    }
+
+    MAP_PHASE phase;
+    memset(&phase, 0, sizeof(phase));
+    phase.spec = spec;
+    phase.use_cache = use_cache;
+    phase.sampling = sampling;
+    phase.scratch_dir = scratch_dir;
+    phase.max_attempts = spec->max_attempts > 0 ? spec->max_attempts : 1;
+    phase.attempt_slots = phase.max_attempts + 1;
+    phase.splits = malloc(split_num * sizeof(SPLIT_STATE));
+    if (!phase.splits) {
+        EXIT_ERROR(ERROR, "Failed to allocate memory for split states\n");
+    }
+
+    /* Shared with the workers and their codec processes */
+    size_t stats_size = split_num * phase.attempt_slots * sizeof(WORKER_STATS);
+    phase.worker_stats = mmap(NULL, stats_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (phase.worker_stats == MAP_FAILED) {
+        EXIT_ERROR(ERROR, "Failed to allocate worker statistics\n");
+    }
+    reset_map_phase(&phase);
+
+    result->intermediate_raw_bytes = 0;
+    result->intermediate_stored_bytes = 0;
+    result->codec_time = 0;
+    result->cache_hits = 0;
+    result->cache_misses = 0;
+    result->map_attempts = 0;
+    result->map_failures = 0;
+    result->speculative_attempts = 0;
+    result->map_worker_cpu = NULL;
+    result->map_worker_node = NULL;
+    result->map_input_node = NULL;
+    result->sampled_chunks = 0;
+    result->total_chunks = 0;
+    result->sample_error = 0;
 
-    close(input_fd);
-    close(result_fd);
+    gettimeofday(&start, NULL);
+
+    /* One plan over all input files, balanced by bytes. The cache needs chunks that stay put when
+       files grow; sampling needs chunks small enough to draw many of them. */
+    SPLIT_PLAN plan;
+    long chunk_size = use_cache ? CACHE_CHUNK_SIZE : (sampling ? SAMPLE_CHUNK_SIZE : 0);
+    if (split_plan_build(spec->input_data_filepath, split_num, chunk_size, &plan) < 0) {
+        EXIT_ERROR(ERROR, "Failed to plan the input splits\n");
+    }
+    if (plan.total_bytes <= 0) {
+        EXIT_ERROR(ERROR, "Invalid or empty input file\n");
+    }
+
+    PLACEMENT placement;
+    int split_slots[split_num];
+    if (spec->cpu_affinity) {
+        if (placement_build(spec->cpu_affinity, &placement) < 0) {
+            EXIT_ERROR(ERROR, "Invalid CPU affinity %s\n", spec->cpu_affinity);
+        }
+        phase.placement = &placement;
+        phase.split_slots = split_slots;
+        result->map_worker_cpu = malloc(split_num * sizeof(int));
+        result->map_worker_node = malloc(split_num * sizeof(int));
+        result->map_input_node = malloc(split_num * sizeof(int));
+        if (!result->map_worker_cpu || !result->map_worker_node || !result->map_input_node) {
+            EXIT_ERROR(ERROR, "Failed to allocate memory for worker placement\n");
+        }
+    }
+
+    /* The result is written next to its final path and renamed into place only once complete */
+    const char * result_file = spec->output_filepath ? spec->output_filepath : "mr.rst";
+    snprintf(result_temp, sizeof(result_temp), "%s.%d.tmp", result_file, getpid());
+    int result_fd = open(result_temp, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (result_fd < 0) {
+        EXIT_ERROR(ERROR, "Failed to create result file\n");
+    }
+
+    if (sampling) {
+        /* The estimator takes the place of the reduce function */
+        run_sampling(&phase, &plan, intermediate_files, result, result_fd);
+        result->reduce_worker_pid = 0;
+    } else {
+        phase.plan = &plan;
+        place_splits(&phase, &plan);
+        run_map_phase(&phase, intermediate_files, result);
+        if (use_cache) {
+            split_cache_sweep(spec->cache_dir);
+        }
+
+        int intermediate_fds[split_num];
+        open_intermediates(spec, intermediate_files, intermediate_fds, result);
+
+        pid_t reduce_pid = fork();
+        if (reduce_pid < 0) {
+            EXIT_ERROR(ERROR, "Failed to fork reduce worker process\n");
+        }
+
+        if (reduce_pid == 0) {  
+            pid_t codec_pids[split_num];
+            if (spec->compress_intermediate) {
+                for (int i = 0; i < split_num; i++) {
+                    int fd_file = intermediate_fds[i];
+                    WORKER_STATS * stats = attempt_stats(&phase, i, phase.splits[i].winner);
+                    intermediate_fds[i] = codec_start_reader(fd_file, &stats->decompress, &codec_pids[i]);
+                    close(fd_file);
+                    if (intermediate_fds[i] < 0) {
+                        EXIT_ERROR(ERROR, "Failed to start the intermediate data decompressor\n");
+                    }
+                }
+            }
+
+            if (spec->reduce_func(intermediate_fds, split_num, result_fd) < 0) {
+                EXIT_ERROR(ERROR, "Reduce function failed\n");
+            }
+
+            if (spec->compress_intermediate) {
+                for (int i = 0; i < split_num; i++) {
+                    if (codec_wait(codec_pids[i]) < 0) {
+                        EXIT_ERROR(ERROR, "Failed to decompress intermediate data\n");
+                    }
+                }
+            }
+
+            exit(0);  
+        } else {
+            result->reduce_worker_pid = reduce_pid;
+        }
+
+        for (int i = 0; i < split_num; i++) {
+            close(intermediate_fds[i]);
+        }
+
+        int status;
+        waitpid(result->reduce_worker_pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            EXIT_ERROR(ERROR, "Reduce worker process failed\n");
+        }
+
+        /* The reducer decompresses every intermediate file, cached pieces included, so its count of raw bytes is complete */
+        add_map_stats(&phase, result);
+    }
+
+    if (close(result_fd) < 0 || rename(result_temp, result_file) < 0) {
+        EXIT_ERROR(ERROR, "Failed to publish result file %s\n", result_file);
+    }
+    result_temp[0] = '\0';
 
     result->filepath = strdup(result_file);
 
+    split_plan_free(&plan);
+    if (phase.placement) {
+        placement_free(&placement);
+    }
+    munmap(phase.worker_stats, stats_size);
+    free(phase.splits);
+    free(phase.attempts);
+    free(intermediate_files);
+    remove_scratch();
+
     gettimeofday(&end, NULL);   
 
     result->processing_time = (end.tv_sec - start.tv_sec) * US_PER_SEC + (end.tv_usec - start.tv_usec);
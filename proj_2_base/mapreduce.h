@@ -1,4 +1,4 @@
-/* You don't need to change this file */
+/* The MapReduce library: a job's specification, what it reports back, and mapreduce() to run it */
 
 #ifndef _MAPREDUCE_H
 #define _MAPREDUCE_H
@@ -13,11 +13,22 @@ typedef struct _data_split
 
 typedef struct _mapreduce_spec
 {
-    char * input_data_filepath; /* The path of the (large) input data file */
+    char * input_data_filepath; /* The input data: a comma-separated list of files, directories and glob patterns */
     int split_num; /* The number of splits */
     int (*map_func)(DATA_SPLIT * split, int fd_out); /* Function pointer to the user-defined map function */
     int (*reduce_func)(int * p_fd_in, int fd_in_num, int fd_out); /* Function pointer to the user-defined reduce function */
     void * usr_data; /* This field is used only by the "Word finder" program: it records the word to find in the input data file */
+    int compress_intermediate; /* Non-zero to block-compress the intermediate data files */
+    char * cache_dir; /* The directory of the split result cache, or NULL to map every split */
+    char * job_name; /* Names the map function in cache keys, such as "counter"; the cache also keys on usr_data as a string */
+    int max_attempts; /* The number of times a failing map split is tried; 0 means once */
+    int straggler_ms; /* Launch a duplicate of a map split still running after this many milliseconds, or 0 never to */
+    char * cpu_affinity; /* Pin map workers to CPUs: "rr" over every allowed CPU, a list such as "0-3,8", or NULL not to pin */
+    double sample_fraction; /* Map at most this fraction of the input's chunks, drawn at random, and estimate the result; 0 maps everything */
+    double sample_error; /* Stop sampling once every estimate's 95% interval is within this fraction of it (see SAMPLE_SUPPORT for rare keys); 0 samples the whole fraction */
+    unsigned int sample_seed; /* Chooses the sampled chunks, so that a sampled run can be repeated */
+    char * scratch_root; /* The job's intermediate files go in a new directory under this one; NULL for $TMPDIR or /tmp */
+    char * output_filepath; /* Where the result file is published, replacing any old one at once; NULL for "mr.rst" */
 }MAPREDUCE_SPEC;
 
 typedef struct _mapreduce_result
@@ -26,6 +37,20 @@ typedef struct _mapreduce_result
     int processing_time; /* The time used (in microseconds) for the mapreduce task */
     int * map_worker_pid; /* To record the process IDs of the map worker processes */
     int reduce_worker_pid; /* To record the process ID of the reduce worker */
+    long intermediate_raw_bytes; /* The size of the intermediate data before compression */
+    long intermediate_stored_bytes; /* The size of the intermediate data files on disk */
+    int codec_time; /* The time (in microseconds) spent compressing and decompressing intermediate data */
+    int cache_hits; /* The number of input chunks whose intermediate data came from the cache */
+    int cache_misses; /* The number of input chunks mapped and added to the cache */
+    int map_attempts; /* The number of map worker processes launched, retries and speculative duplicates included */
+    int map_failures; /* The number of map attempts that failed */
+    int speculative_attempts; /* The number of speculative duplicates launched for stragglers */
+    int * map_worker_cpu; /* With spec->cpu_affinity: the CPU each split's map worker ran on; NULL otherwise */
+    int * map_worker_node; /* With spec->cpu_affinity: the NUMA node each split's map worker ran on */
+    int * map_input_node; /* With spec->cpu_affinity: the node holding most of each split's input once mapped, or -1 if unknown */
+    int sampled_chunks; /* With sampling: the number of input chunks mapped */
+    int total_chunks; /* With sampling: the number of input chunks */
+    double sample_error; /* With sampling: the largest 95% interval half-width relative to its estimate, as sample_max_error() measures it */
 }MAPREDUCE_RESULT;
 
 
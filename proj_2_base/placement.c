@@ -0,0 +1,316 @@
+#define _GNU_SOURCE /* sched_setaffinity, CPU_SET */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "placement.h"
+#include "common.h"
+
+#define MAX_NODES 64 /* Nodes past this are treated as unknown */
+#define SAMPLE_PAGES 64 /* The most resident pages looked up per piece */
+
+
+/* @ret: The NUMA node of a CPU, from sysfs; 0 on a machine without NUMA information */
+static int cpu_node(int cpu)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR * dir = opendir(path);
+    if (!dir) {
+        return 0;
+    }
+
+    int node = 0;
+    struct dirent * entry;
+    while ((entry = readdir(dir))) {
+        if (!strncmp(entry->d_name, "node", 4) && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node < MAX_NODES ? node : 0;
+}
+
+static int add_slot(PLACEMENT * placement, int * capacity, int cpu)
+{
+    if (placement->slot_num == *capacity) {
+        int new_capacity = *capacity ? 2 * *capacity : 16;
+        int * cpus = realloc(placement->cpus, new_capacity * sizeof(int));
+        if (!cpus) {
+            return -1;
+        }
+        placement->cpus = cpus;
+        int * nodes = realloc(placement->nodes, new_capacity * sizeof(int));
+        if (!nodes) {
+            return -1;
+        }
+        placement->nodes = nodes;
+        *capacity = new_capacity;
+    }
+
+    int node = cpu_node(cpu);
+    placement->cpus[placement->slot_num] = cpu;
+    placement->nodes[placement->slot_num] = node;
+    placement->slot_num++;
+    return 0;
+}
+
+/* Build the CPU slots of the map workers.
+   @param cpu_list: "rr" for every CPU this process may run on, or a list such as "0-3,8".
+   @param placement: The placement to fill in; release it with placement_free().
+   @ret: 0 on success, -1 on error, such as a CPU this process may not run on.
+ */
+int placement_build(const char * cpu_list, PLACEMENT * placement)
+{
+    memset(placement, 0, sizeof(*placement));
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        return -1;
+    }
+
+    int capacity = 0;
+    if (!strcmp(cpu_list, "rr")) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && add_slot(placement, &capacity, cpu) < 0) {
+                placement_free(placement);
+                return -1;
+            }
+        }
+        return placement->slot_num > 0 ? 0 : -1;
+    }
+
+    const char * p = cpu_list;
+    while (*p) {
+        char * q;
+        long first = strtol(p, &q, 10);
+        long last = first;
+        if (q == p) {
+            ERR_MSG("Invalid CPU list %s\n", cpu_list);
+            placement_free(placement);
+            return -1;
+        }
+        if (*q == '-') {
+            p = q + 1;
+            last = strtol(p, &q, 10);
+            if (q == p) {
+                ERR_MSG("Invalid CPU list %s\n", cpu_list);
+                placement_free(placement);
+                return -1;
+            }
+        }
+
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)) {
+                ERR_MSG("CPU %ld is not available\n", cpu);
+                placement_free(placement);
+                return -1;
+            }
+            if (add_slot(placement, &capacity, cpu) < 0) {
+                placement_free(placement);
+                return -1;
+            }
+        }
+
+        p = *q == ',' ? q + 1 : q;
+        if (*q && *q != ',') {
+            ERR_MSG("Invalid CPU list %s\n", cpu_list);
+            placement_free(placement);
+            return -1;
+        }
+    }
+
+    return placement->slot_num > 0 ? 0 : -1;
+}
+
+void placement_free(PLACEMENT * placement)
+{
+    free(placement->cpus);
+    free(placement->nodes);
+    memset(placement, 0, sizeof(*placement));
+}
+
+/* Count the NUMA nodes of a sample of the page-cache pages of a file range that are resident.
+   Pages not in the page cache are left alone, so nothing is read from disk.
+ */
+static void sample_page_nodes(const char * path, off_t start, off_t end, int * node_pages)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    off_t first = start / page_size * page_size;
+    if (end <= start) {
+        return;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    size_t len = end - first;
+    char * map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, first);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    size_t page_num = (len + page_size - 1) / page_size;
+    unsigned char * resident = malloc(page_num);
+    if (resident && mincore(map, len, resident) == 0) {
+        size_t resident_num = 0;
+        for (size_t i = 0; i < page_num; i++) {
+            resident_num += resident[i] & 1;
+        }
+
+        void * pages[SAMPLE_PAGES];
+        int status[SAMPLE_PAGES];
+        size_t stride = resident_num / SAMPLE_PAGES + 1;
+        size_t seen = 0;
+        int n = 0;
+        for (size_t i = 0; i < page_num && n < SAMPLE_PAGES; i++) {
+            if ((resident[i] & 1) && seen++ % stride == 0) {
+                /* move_pages() only reports pages mapped into this process; the touch is a minor fault */
+                *(volatile char *)(map + i * page_size);
+                pages[n++] = map + i * page_size;
+            }
+        }
+
+        /* With no target nodes, move_pages() moves nothing and reports the node of every page */
+        if (n > 0 && syscall(SYS_move_pages, 0, n, pages, NULL, status, 0) == 0) {
+            for (int i = 0; i < n; i++) {
+                if (status[i] >= 0 && status[i] < MAX_NODES) {
+                    node_pages[status[i]]++;
+                }
+            }
+        }
+    }
+
+    free(resident);
+    munmap(map, len);
+}
+
+/* Find the NUMA node holding most of a split's input in the page cache.
+   @ret: The node, or -1 if none of the split's input is cached or the node cannot be told.
+ */
+int placement_split_node(SPLIT_PLAN * plan, int split)
+{
+    int node_pages[MAX_NODES] = {0};
+
+    for (int p = plan->piece_bounds[split]; p < plan->piece_bounds[split + 1]; p++) {
+        SPLIT_PIECE * piece = &plan->pieces[p];
+        INPUT_FILE * file = &plan->files[piece->file];
+        if (file->format == INPUT_PLAIN) {
+            sample_page_nodes(file->path, piece->start, piece->end, node_pages);
+        } else if (piece->end > piece->start) {
+            FRAME * last = &file->frame_index.frames[piece->end - 1];
+            sample_page_nodes(file->path, file->frame_index.frames[piece->start].offset,
+                              last->offset + last->size, node_pages);
+        }
+    }
+
+    int best = -1;
+    for (int node = 0; node < MAX_NODES; node++) {
+        if (node_pages[node] > 0 && (best < 0 || node_pages[node] > node_pages[best])) {
+            best = node;
+        }
+    }
+    return best;
+}
+
+/* Choose the CPU slot of every split.
+   A split goes to the least loaded slot on the node of its cached input, or to the least loaded
+   slot overall when its node is unknown or has no slot; ties go to the lower slot, so splits
+   with no cached input are spread round-robin.
+   @param split_nodes: The node of every split, from placement_split_node().
+   @param split_slots: Receives the slot of every split.
+ */
+void placement_assign(PLACEMENT * placement, const int * split_nodes, int split_num, int * split_slots)
+{
+    int * load = calloc(placement->slot_num, sizeof(int));
+
+    for (int i = 0; i < split_num; i++) {
+        int best = -1;
+        for (int pass = 0; pass < 2 && best < 0; pass++) {
+            for (int s = 0; s < placement->slot_num; s++) {
+                if (pass == 0 && placement->nodes[s] != split_nodes[i]) {
+                    continue;
+                }
+                if (best < 0 || (load && load[s] < load[best])) {
+                    best = s;
+                }
+            }
+        }
+        split_slots[i] = best;
+        if (load) {
+            load[best]++;
+        }
+    }
+
+    free(load);
+}
+
+/* Choose the slot of a later attempt at a split: the attempt-th slot after the split's own on the
+   same node, so that a retry or a speculative duplicate does not share the straggler's CPU */
+int placement_attempt_slot(PLACEMENT * placement, int slot, int attempt)
+{
+    int node = placement->nodes[slot];
+    int count = 0;
+    int index = 0;
+
+    for (int s = 0; s < placement->slot_num; s++) {
+        if (placement->nodes[s] == node) {
+            if (s == slot) {
+                index = count;
+            }
+            count++;
+        }
+    }
+
+    int target = (index + attempt) % count;
+    for (int s = 0; s < placement->slot_num; s++) {
+        if (placement->nodes[s] == node && target-- == 0) {
+            return s;
+        }
+    }
+    return slot;
+}
+
+/* Pin the calling process to the CPU of a slot and make it allocate memory on that CPU's node.
+   The memory policy prefers the node rather than binding to it, so a full node falls back to
+   the others instead of failing. Both are inherited by the processes it forks.
+   @ret: 0 on success, -1 on error.
+ */
+int placement_apply(PLACEMENT * placement, int slot)
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(placement->cpus[slot], &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+        return -1;
+    }
+
+    /* A kernel without NUMA support has no memory policy to set, and needs none */
+    unsigned long nodemask = 1UL << placement->nodes[slot];
+    syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8 + 1);
+    return 0;
+}
+
+/* Find where the calling process is running */
+void placement_current(int * p_cpu, int * p_node)
+{
+    unsigned int cpu = 0;
+    unsigned int node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0) {
+        *p_cpu = -1;
+        *p_node = -1;
+        return;
+    }
+    *p_cpu = cpu;
+    *p_node = node;
+}
@@ -0,0 +1,27 @@
+/* CPU and NUMA placement of map workers.
+   Every map worker can be pinned to one CPU slot, and its memory policy set to prefer the NUMA
+   node of that CPU, so its buffers, its codec process and the page cache it fills stay local.
+   A split whose input is already in the page cache goes to a CPU on the node holding most of
+   those pages; other splits are spread over the slots round-robin. */
+
+#ifndef _PLACEMENT_H
+#define _PLACEMENT_H
+
+#include "split_plan.h"
+
+typedef struct _placement
+{
+    int slot_num; /* The number of CPU slots */
+    int * cpus; /* The CPU of every slot, in the order they were named */
+    int * nodes; /* The NUMA node of every slot's CPU */
+}PLACEMENT;
+
+int placement_build(const char * cpu_list, PLACEMENT * placement);
+void placement_free(PLACEMENT * placement);
+int placement_split_node(SPLIT_PLAN * plan, int split);
+void placement_assign(PLACEMENT * placement, const int * split_nodes, int split_num, int * split_slots);
+int placement_attempt_slot(PLACEMENT * placement, int slot, int attempt);
+int placement_apply(PLACEMENT * placement, int slot);
+void placement_current(int * p_cpu, int * p_node);
+
+#endif
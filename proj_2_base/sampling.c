@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sampling.h"
+#include "common.h"
+
+#define Z_95 1.96 /* The normal quantile of a two-sided 95% interval */
+
+
+static uint64_t splitmix64(uint64_t * state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* Fill order with a random permutation of 0 .. n - 1 that depends only on seed */
+void sample_order(int * order, int n, uint64_t seed)
+{
+    uint64_t state = seed;
+    for (int i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    for (int i = n - 1; i > 0; i--) {
+        int j = splitmix64(&state) % (uint64_t)(i + 1);
+        int t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+}
+
+void sample_stats_init(SAMPLE_STATS * stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+void sample_stats_free(SAMPLE_STATS * stats)
+{
+    for (int k = 0; k < stats->key_num; k++) {
+        free(stats->keys[k].key);
+    }
+    free(stats->keys);
+    memset(stats, 0, sizeof(*stats));
+}
+
+static SAMPLE_KEY * find_key(SAMPLE_STATS * stats, const char * key)
+{
+    /* Sampled jobs have few keys, such as the 26 letters */
+    for (int k = 0; k < stats->key_num; k++) {
+        if (!strcmp(stats->keys[k].key, key)) {
+            return &stats->keys[k];
+        }
+    }
+
+    if (stats->key_num == stats->key_capacity) {
+        int capacity = stats->key_capacity ? 2 * stats->key_capacity : 32;
+        SAMPLE_KEY * keys = realloc(stats->keys, capacity * sizeof(SAMPLE_KEY));
+        if (!keys) {
+            return NULL;
+        }
+        stats->keys = keys;
+        stats->key_capacity = capacity;
+    }
+
+    SAMPLE_KEY * entry = &stats->keys[stats->key_num];
+    memset(entry, 0, sizeof(*entry));
+    entry->key = strdup(key);
+    if (!entry->key) {
+        return NULL;
+    }
+    stats->key_num++;
+    return entry;
+}
+
+/* Add the chunk just read to the sums */
+static void end_chunk(SAMPLE_STATS * stats, double x)
+{
+    stats->chunk_num++;
+    stats->x_sum += x;
+    stats->x2_sum += x * x;
+    for (int k = 0; k < stats->key_num; k++) {
+        SAMPLE_KEY * entry = &stats->keys[k];
+        entry->y_sum += entry->chunk_y;
+        entry->y2_sum += entry->chunk_y * entry->chunk_y;
+        entry->xy_sum += x * entry->chunk_y;
+        entry->chunk_y = 0;
+    }
+}
+
+/* Add the chunks of one intermediate data file to the sums.
+   Each chunk's map output starts with a SAMPLE_PIECE_MARK line; other lines that are not
+   "key value" are ignored.
+   @ret: 0 on success, -1 on error.
+ */
+int sample_stats_read(SAMPLE_STATS * stats, FILE * in)
+{
+    char * line = NULL;
+    size_t line_capacity = 0;
+    int in_chunk = 0;
+    double x = 0;
+    int ret = 0;
+
+    while (getline(&line, &line_capacity, in) != -1) {
+        char key[256];
+        double value;
+
+        if (!strncmp(line, SAMPLE_PIECE_MARK " ", strlen(SAMPLE_PIECE_MARK) + 1)) {
+            if (in_chunk) {
+                end_chunk(stats, x);
+            }
+            x = atof(line + strlen(SAMPLE_PIECE_MARK) + 1);
+            in_chunk = 1;
+        } else if (in_chunk && sscanf(line, "%255s %lf", key, &value) == 2) {
+            SAMPLE_KEY * entry = find_key(stats, key);
+            if (!entry) {
+                ret = -1;
+                break;
+            }
+            entry->chunk_y += value;
+        }
+    }
+    if (in_chunk) {
+        end_chunk(stats, x);
+    }
+
+    free(line);
+    return ret;
+}
+
+/* Estimate a key's total with the ratio estimator: the sampled value per byte times all bytes.
+   Its variance is N^2 (1 - n/N) / n times the sample variance of y - R x over the chunks.
+ */
+static void estimate(SAMPLE_STATS * stats, SAMPLE_KEY * entry, int chunk_total, double bytes_total,
+                     double * p_estimate, double * p_half_width)
+{
+    int n = stats->chunk_num;
+    double r = stats->x_sum > 0 ? entry->y_sum / stats->x_sum : 0;
+
+    *p_estimate = r * bytes_total;
+    if (n >= chunk_total) {
+        *p_half_width = 0; /* Every chunk was read */
+        return;
+    }
+    if (n < 2) {
+        *p_half_width = INFINITY;
+        return;
+    }
+
+    double residual = entry->y2_sum - 2 * r * entry->xy_sum + r * r * stats->x2_sum;
+    double variance = (double)chunk_total * chunk_total * (1 - (double)n / chunk_total) / n * (residual > 0 ? residual : 0) / (n - 1);
+    *p_half_width = Z_95 * sqrt(variance);
+}
+
+/* @ret: The largest 95% interval half-width relative to its estimate, or to SAMPLE_SUPPORT of
+         the total of all estimates if that is larger; 0 if nothing is estimated above zero.
+ */
+double sample_max_error(SAMPLE_STATS * stats, int chunk_total, double bytes_total)
+{
+    double total = 0;
+    for (int k = 0; k < stats->key_num; k++) {
+        double value, half_width;
+        estimate(stats, &stats->keys[k], chunk_total, bytes_total, &value, &half_width);
+        total += value;
+    }
+
+    double max_error = 0;
+    for (int k = 0; k < stats->key_num; k++) {
+        double value, half_width;
+        estimate(stats, &stats->keys[k], chunk_total, bytes_total, &value, &half_width);
+        double scale = value > SAMPLE_SUPPORT * total ? value : SAMPLE_SUPPORT * total;
+        if (scale > 0 && half_width / scale > max_error) {
+            max_error = half_width / scale;
+        }
+    }
+    return max_error;
+}
+
+/* Write the estimated result: one "key estimate +/- half_width" line per key, the half-width
+   being that of a 95% confidence interval.
+   @ret: 0 on success, -1 on error.
+ */
+int sample_write(SAMPLE_STATS * stats, int chunk_total, double bytes_total, int fd_out)
+{
+    for (int k = 0; k < stats->key_num; k++) {
+        double value, half_width;
+        estimate(stats, &stats->keys[k], chunk_total, bytes_total, &value, &half_width);
+        if (dprintf(fd_out, "%s %.0f +/- %.0f\n", stats->keys[k].key, value, half_width) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
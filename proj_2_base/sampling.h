@@ -0,0 +1,51 @@
+/* Approximate jobs by sampling.
+   The input is cut into chunks at line boundaries, and only a random subset of them, in an
+   order fixed by a seed, is mapped. The job's map output must be lines of "key value" with an
+   integer value whose reduce is a sum, as for the letter counter and the match counter; each
+   key's total is then estimated from the sampled chunks with the ratio estimator (scaled by
+   bytes), together with a 95% confidence interval.
+
+   The error of a sample is the largest half-width of those intervals relative to its key's
+   estimate, except that a key estimated below SAMPLE_SUPPORT of the total of all keys is held
+   to that share of the total instead: rare keys such as "Z" in the letter counter would
+   otherwise need nearly every chunk before any error bound is met. */
+
+#ifndef _SAMPLING_H
+#define _SAMPLING_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define SAMPLE_CHUNK_SIZE (64 * 1024) /* The nominal size of a sampled chunk */
+#define SAMPLE_MIN_CHUNKS 8 /* No error bound is trusted before this many chunks are sampled */
+#define SAMPLE_PIECE_MARK "#piece" /* Starts each chunk's map output: "#piece <bytes>" */
+#define SAMPLE_SUPPORT 0.01 /* Keys below this share of the total have their error measured against the share */
+
+/* The sums over the sampled chunks of one key */
+typedef struct _sample_key
+{
+    char * key;
+    double y_sum; /* The sum of the key's value per chunk */
+    double y2_sum; /* The sum of its squares */
+    double xy_sum; /* The sum of its products with the chunk's bytes */
+    double chunk_y; /* The key's value in the chunk being read */
+}SAMPLE_KEY;
+
+typedef struct _sample_stats
+{
+    int chunk_num; /* The number of chunks read */
+    double x_sum; /* The sum of the chunks' bytes */
+    double x2_sum; /* The sum of their squares */
+    SAMPLE_KEY * keys; /* In order of first appearance */
+    int key_num;
+    int key_capacity;
+}SAMPLE_STATS;
+
+void sample_order(int * order, int n, uint64_t seed);
+void sample_stats_init(SAMPLE_STATS * stats);
+void sample_stats_free(SAMPLE_STATS * stats);
+int sample_stats_read(SAMPLE_STATS * stats, FILE * in);
+double sample_max_error(SAMPLE_STATS * stats, int chunk_total, double bytes_total);
+int sample_write(SAMPLE_STATS * stats, int chunk_total, double bytes_total, int fd_out);
+
+#endif
@@ -0,0 +1,260 @@
+#define _GNU_SOURCE /* copy_file_range */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+#include "split_cache.h"
+#include "common.h"
+
+#define CACHE_VERSION "mr-cache-1"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char * p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t read32(const unsigned char * p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t hash_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= hash_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+/* A 64-bit hash of a buffer (the XXH64 algorithm), fast enough to fingerprint every input chunk */
+uint64_t cache_hash64(const void * data, size_t len, uint64_t seed)
+{
+    const unsigned char * p = data;
+    const unsigned char * end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+        while (p + 32 <= end) {
+            v1 = hash_round(v1, read64(p));
+            v2 = hash_round(v2, read64(p + 8));
+            v3 = hash_round(v3, read64(p + 16));
+            v4 = hash_round(v4, read64(p + 24));
+            p += 32;
+        }
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = hash_merge(h, v1);
+        h = hash_merge(h, v2);
+        h = hash_merge(h, v3);
+        h = hash_merge(h, v4);
+    } else {
+        h = seed + PRIME64_5;
+    }
+
+    h += len;
+    while (p + 8 <= end) {
+        h ^= hash_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= *p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* Fingerprint size bytes of a file at offset start by their content, so the fingerprint survives appends to the file */
+static int hash_file_range(const char * path, off_t start, size_t size, uint64_t * p_hash)
+{
+    char * buf = malloc(size ? size : 1);
+    int fd = open(path, O_RDONLY);
+    int ret = -1;
+
+    if (buf && fd >= 0) {
+        size_t done = 0;
+        while (done < size) {
+            ssize_t n = pread(fd, buf + done, size - done, start + done);
+            if (n <= 0) {
+                break;
+            }
+            done += n;
+        }
+        if (done == size) {
+            *p_hash = cache_hash64(buf, size, 0);
+            ret = 0;
+        }
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(buf);
+    return ret;
+}
+
+/* Find the cache entry of a piece.
+   A piece is keyed by its content: the bytes of a plain-text piece, or the compressed bytes of
+   the frames of a compressed one, so that the frames already there still hit after more are
+   appended. For a compressed piece, the frames its last line runs into are hashed with its own,
+   and whether it starts mid-line is part of the key. The key also covers the job name, usr_data (as a string) and whether the
+   intermediate data is compressed.
+   @param plan: The split plan.
+   @param piece: The piece.
+   @param spec: The job; spec->job_name must be set.
+   @param path: Receives the path of the entry in spec->cache_dir, which may not exist yet.
+   @param path_size: The size of the path buffer.
+   @ret: 0 on success, -1 on error.
+ */
+int split_cache_entry(SPLIT_PLAN * plan, SPLIT_PIECE * piece, MAPREDUCE_SPEC * spec, char * path, size_t path_size)
+{
+    INPUT_FILE * file = &plan->files[piece->file];
+    char source[512];
+
+    uint64_t content_hash;
+    if (file->format == INPUT_PLAIN) {
+        if (hash_file_range(file->path, piece->start, piece->end - piece->start, &content_hash) < 0) {
+            return -1;
+        }
+        snprintf(source, sizeof(source), "content:%016llx:%lld",
+                 (unsigned long long)content_hash, (long long)(piece->end - piece->start));
+    } else {
+        /* The piece's lines can start in an earlier frame and end in a later one, so the key
+           also covers the frames they run into and whether the piece starts mid-line */
+        int skip_line, tail_end;
+        int fd = open(file->path, O_RDONLY);
+        if (fd < 0) {
+            return -1;
+        }
+        int ret = frame_split_context(fd, &file->frame_index, piece->start, piece->end, &skip_line, &tail_end);
+        close(fd);
+        if (ret < 0) {
+            return -1;
+        }
+
+        FRAME * first = &file->frame_index.frames[piece->start];
+        FRAME * last = &file->frame_index.frames[tail_end - 1];
+        off_t size = last->offset + last->size - first->offset;
+        if (hash_file_range(file->path, first->offset, size, &content_hash) < 0) {
+            return -1;
+        }
+        snprintf(source, sizeof(source), "frames:%d:%d:%016llx:%lld",
+                 file->format, skip_line, (unsigned long long)content_hash, (long long)size);
+    }
+
+    const char * usr_data = spec->usr_data ? (const char *)spec->usr_data : "";
+    size_t key_len = strlen(CACHE_VERSION) + strlen(spec->job_name) + strlen(usr_data) + strlen(source) + 8;
+    char * key = malloc(key_len);
+    if (!key) {
+        return -1;
+    }
+    /* NUL separators keep the fields from running into each other */
+    int n = snprintf(key, key_len, "%s%c%s%c%s%c%d%c%s", CACHE_VERSION, 0, spec->job_name, 0,
+                     usr_data, 0, spec->compress_intermediate != 0, 0, source);
+
+    snprintf(path, path_size, "%s/%016llx%016llx.itm", spec->cache_dir,
+             (unsigned long long)cache_hash64(key, n, 0), (unsigned long long)cache_hash64(key, n, PRIME64_1));
+    free(key);
+    return 0;
+}
+
+/* Remove the temporary entries left in a cache directory by map workers that died before
+   storing them, such as losing speculative attempts, which are killed */
+void split_cache_sweep(const char * cache_dir)
+{
+    DIR * dir = opendir(cache_dir);
+    if (!dir) {
+        return;
+    }
+
+    struct dirent * d;
+    while ((d = readdir(dir))) {
+        /* Temporary entries are named "<entry>.itm.<pid>.tmp" */
+        char hex[33];
+        int pid, tail;
+        if (sscanf(d->d_name, "%32[0-9a-f].itm.%d.tmp%n", hex, &pid, &tail) == 2 &&
+            d->d_name[tail] == '\0' && pid > 0 && kill(pid, 0) < 0 && errno == ESRCH) {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s", cache_dir, d->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+/* Append a cache entry to an intermediate file.
+   @ret: 0 on success, -1 on error.
+ */
+int split_cache_copy(const char * path, int fd_out)
+{
+    int fd_in = open(path, O_RDONLY);
+    if (fd_in < 0) {
+        return -1;
+    }
+
+    int ret = 0;
+    ssize_t n;
+    off_t copied = 0;
+    /* copy_file_range() stays in the kernel; fall back to read() and write() where it is not supported */
+    while ((n = copy_file_range(fd_in, NULL, fd_out, NULL, 1 << 30, 0)) > 0) {
+        copied += n;
+    }
+    if (n < 0 && copied > 0) {
+        ret = -1;
+    } else if (n < 0) {
+        char buf[64 * 1024];
+        lseek(fd_in, 0, SEEK_SET);
+        while ((n = read(fd_in, buf, sizeof(buf))) > 0) {
+            if (write_full(fd_out, buf, n) < 0) {
+                ret = -1;
+                break;
+            }
+        }
+        if (n < 0) {
+            ret = -1;
+        }
+    }
+
+    close(fd_in);
+    return ret;
+}
@@ -0,0 +1,22 @@
+/* The split result cache.
+   With the cache enabled, input files are cut into chunks whose boundaries do not move when
+   data is appended (whole frames for compressed input), and the intermediate output of every
+   chunk is stored under a key made of the chunk's content hash, the job name and usr_data.
+   A rerun over a grown log finds the unchanged chunks in the cache and only maps the new ones. */
+
+#ifndef _SPLIT_CACHE_H
+#define _SPLIT_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "mapreduce.h"
+#include "split_plan.h"
+
+#define CACHE_CHUNK_SIZE (1024 * 1024) /* The nominal size of a cached chunk; chunks end at line boundaries */
+
+uint64_t cache_hash64(const void * data, size_t len, uint64_t seed);
+int split_cache_entry(SPLIT_PLAN * plan, SPLIT_PIECE * piece, MAPREDUCE_SPEC * spec, char * path, size_t path_size);
+int split_cache_copy(const char * path, int fd_out);
+void split_cache_sweep(const char * cache_dir);
+
+#endif
@@ -0,0 +1,382 @@
+#define _GNU_SOURCE /* memfd_create */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "split_plan.h"
+#include "common.h"
+
+#define SCAN_CHUNK 4096
+
+
+static int add_file(SPLIT_PLAN * plan, int * capacity, const char * path, struct stat * st)
+{
+    if (plan->file_num == *capacity) {
+        int new_capacity = *capacity ? 2 * *capacity : 16;
+        INPUT_FILE * files = realloc(plan->files, new_capacity * sizeof(INPUT_FILE));
+        if (!files) {
+            return -1;
+        }
+        plan->files = files;
+        *capacity = new_capacity;
+    }
+
+    INPUT_FILE * file = &plan->files[plan->file_num];
+    memset(file, 0, sizeof(*file));
+    file->path = strdup(path);
+    file->size = st->st_size;
+    file->dev = st->st_dev;
+    file->ino = st->st_ino;
+    file->mtime = st->st_mtim;
+    if (!file->path) {
+        return -1;
+    }
+    plan->file_num++;
+    return 0;
+}
+
+static int filter_visible(const struct dirent * entry)
+{
+    return entry->d_name[0] != '.';
+}
+
+/* Add a regular file, or the regular files directly inside a directory in name order */
+static int add_path(SPLIT_PLAN * plan, int * capacity, const char * path)
+{
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        ERR_MSG("Input %s does not exist\n", path);
+        return -1;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        return add_file(plan, capacity, path, &st);
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        ERR_MSG("Input %s is neither a regular file nor a directory\n", path);
+        return -1;
+    }
+
+    struct dirent ** entries;
+    int entry_num = scandir(path, &entries, filter_visible, alphasort);
+    if (entry_num < 0) {
+        ERR_MSG("Failed to read directory %s\n", path);
+        return -1;
+    }
+
+    int ret = 0;
+    for (int i = 0; i < entry_num; i++) {
+        char child[4096];
+        snprintf(child, sizeof(child), "%s/%s", path, entries[i]->d_name);
+        if (ret == 0 && stat(child, &st) == 0 && S_ISREG(st.st_mode)) {
+            ret = add_file(plan, capacity, child, &st);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    return ret;
+}
+
+/* Expand the comma-separated list of files, directories and glob patterns into plan->files */
+static int expand_input(const char * input, SPLIT_PLAN * plan)
+{
+    char * list = strdup(input);
+    char * save = NULL;
+    int capacity = 0;
+    int ret = 0;
+
+    if (!list) {
+        return -1;
+    }
+
+    for (char * entry = strtok_r(list, ",", &save); entry && ret == 0; entry = strtok_r(NULL, ",", &save)) {
+        if (!strpbrk(entry, "*?[")) {
+            ret = add_path(plan, &capacity, entry);
+            continue;
+        }
+
+        glob_t matches;
+        if (glob(entry, 0, NULL, &matches) != 0) {
+            ERR_MSG("No input matches %s\n", entry);
+            ret = -1;
+            break;
+        }
+        for (size_t i = 0; i < matches.gl_pathc && ret == 0; i++) {
+            ret = add_path(plan, &capacity, matches.gl_pathv[i]);
+        }
+        globfree(&matches);
+    }
+
+    free(list);
+    return ret;
+}
+
+/* Find the end of the line that holds byte offset pos.
+   @ret: The offset just after the newline ending that line, or the file size if the line is the last one.
+ */
+static off_t line_end(int fd, off_t pos, off_t file_size)
+{
+    char buf[SCAN_CHUNK];
+    while (pos < file_size) {
+        ssize_t n = pread(fd, buf, sizeof(buf), pos);
+        if (n <= 0) {
+            break;
+        }
+        char * nl = memchr(buf, '\n', n);
+        if (nl) {
+            return pos + (nl - buf) + 1;
+        }
+        pos += n;
+    }
+    return file_size;
+}
+
+static long frame_weight(FRAME * frame)
+{
+    return frame->raw_size >= 0 ? frame->raw_size : frame->size;
+}
+
+static int add_piece(SPLIT_PLAN * plan, int * capacity, int file, off_t start, off_t end)
+{
+    if (plan->piece_num == *capacity) {
+        int new_capacity = *capacity ? 2 * *capacity : 16;
+        SPLIT_PIECE * pieces = realloc(plan->pieces, new_capacity * sizeof(SPLIT_PIECE));
+        if (!pieces) {
+            return -1;
+        }
+        plan->pieces = pieces;
+        *capacity = new_capacity;
+    }
+    plan->pieces[plan->piece_num].file = file;
+    plan->pieces[plan->piece_num].start = start;
+    plan->pieces[plan->piece_num].end = end;
+    plan->piece_num++;
+    return 0;
+}
+
+/* Build the split plan of a job.
+   @param input: A comma-separated list of files, directories (their regular files, in name order)
+                 and glob patterns.
+   @param split_num: The number of splits.
+   @param chunk_size: If non-zero, every piece is one chunk of about this many bytes, and chunk
+                      boundaries depend only on the file itself, so they stay put when data is
+                      appended to the file. Splits are then balanced to within one chunk.
+   @param plan: The plan to fill in; release it with split_plan_free().
+   @ret: 0 on success, -1 on error.
+ */
+int split_plan_build(const char * input, int split_num, long chunk_size, SPLIT_PLAN * plan)
+{
+    memset(plan, 0, sizeof(*plan));
+    plan->split_num = split_num;
+    plan->piece_bounds = calloc(split_num + 1, sizeof(int));
+    if (!plan->piece_bounds || expand_input(input, plan) < 0) {
+        split_plan_free(plan);
+        return -1;
+    }
+
+    for (int f = 0; f < plan->file_num; f++) {
+        INPUT_FILE * file = &plan->files[f];
+        int fd = open(file->path, O_RDONLY);
+        if (fd < 0) {
+            ERR_MSG("Failed to open input file %s\n", file->path);
+            split_plan_free(plan);
+            return -1;
+        }
+
+        file->format = frame_detect_format(fd);
+        if (file->format == INPUT_PLAIN) {
+            plan->total_bytes += file->size;
+        } else {
+            if (frame_index_build(fd, file->format, &file->frame_index) < 0) {
+                ERR_MSG("Failed to index compressed input file %s\n", file->path);
+                close(fd);
+                split_plan_free(plan);
+                return -1;
+            }
+            for (int j = 0; j < file->frame_index.frame_num; j++) {
+                plan->total_bytes += frame_weight(&file->frame_index.frames[j]);
+            }
+            if (file->frame_index.frame_num == 1 && split_num > 1) {
+                DEBUG_MSG("%s is a single compressed frame, so one map worker reads all of it\n", file->path);
+            }
+        }
+        close(fd);
+    }
+
+    /* Split k ends once the bytes assigned so far reach its share (k + 1) / split_num of the
+       total, so that rounding at line and frame boundaries does not accumulate */
+    int capacity = 0;
+    int k = 0;
+    long done = 0;
+    double share = (double)plan->total_bytes / split_num;
+
+    for (int f = 0; f < plan->file_num; f++) {
+        INPUT_FILE * file = &plan->files[f];
+
+        if (file->format == INPUT_PLAIN) {
+            int fd = open(file->path, O_RDONLY);
+            if (fd < 0) {
+                split_plan_free(plan);
+                return -1;
+            }
+
+            off_t pos = 0;
+            while (pos < file->size) {
+                off_t end = file->size;
+                if (chunk_size > 0) {
+                    /* Chunk j ends with the line holding byte j * chunk_size - 1 */
+                    off_t boundary = (pos / chunk_size + 1) * chunk_size;
+                    if (boundary < file->size) {
+                        end = line_end(fd, boundary - 1, file->size);
+                    }
+                } else if (k < split_num - 1) {
+                    long room = (long)(share * (k + 1)) - done;
+                    if (room < 1) {
+                        room = 1;
+                    }
+                    if (pos + room < file->size) {
+                        end = line_end(fd, pos + room - 1, file->size);
+                    }
+                }
+
+                if (end - pos > SPLIT_PIECE_MAX) {
+                    end = line_end(fd, pos + SPLIT_PIECE_MAX - 1, file->size);
+                }
+
+                if (add_piece(plan, &capacity, f, pos, end) < 0) {
+                    close(fd);
+                    split_plan_free(plan);
+                    return -1;
+                }
+                done += end - pos;
+                pos = end;
+                while (k < split_num - 1 && done >= (long)(share * (k + 1))) {
+                    plan->piece_bounds[++k] = plan->piece_num;
+                }
+            }
+            close(fd);
+        } else {
+            FRAME_INDEX * index = &file->frame_index;
+            int first = 0;
+            long chunk_weight = 0;
+            long piece_weight = 0;
+            for (int j = 0; j < index->frame_num; j++) {
+                long weight = frame_weight(&index->frames[j]);
+                /* Close the split before a frame whose larger half lies past the split's share.
+                   Chunks are never cut, so with chunking this is only decided between chunks. */
+                long half = chunk_size > 0 ? 0 : weight / 2;
+                if (k < split_num - 1 && (chunk_size == 0 || j == first) &&
+                    done + half >= (long)(share * (k + 1))) {
+                    if (j > first && add_piece(plan, &capacity, f, first, j) < 0) {
+                        split_plan_free(plan);
+                        return -1;
+                    }
+                    first = j;
+                    piece_weight = 0;
+                    while (k < split_num - 1 && done + half >= (long)(share * (k + 1))) {
+                        plan->piece_bounds[++k] = plan->piece_num;
+                    }
+                }
+                if (j > first && piece_weight + weight > SPLIT_PIECE_MAX) {
+                    if (add_piece(plan, &capacity, f, first, j) < 0) {
+                        split_plan_free(plan);
+                        return -1;
+                    }
+                    first = j;
+                    piece_weight = 0;
+                }
+                done += weight;
+                chunk_weight += weight;
+                piece_weight += weight;
+
+                if (chunk_size > 0 && chunk_weight >= chunk_size) {
+                    if (add_piece(plan, &capacity, f, first, j + 1) < 0) {
+                        split_plan_free(plan);
+                        return -1;
+                    }
+                    first = j + 1;
+                    chunk_weight = 0;
+                    piece_weight = 0;
+                }
+            }
+            if (index->frame_num > first && add_piece(plan, &capacity, f, first, index->frame_num) < 0) {
+                split_plan_free(plan);
+                return -1;
+            }
+        }
+    }
+
+    while (k < split_num) {
+        plan->piece_bounds[++k] = plan->piece_num;
+    }
+    return 0;
+}
+
+void split_plan_free(SPLIT_PLAN * plan)
+{
+    for (int f = 0; f < plan->file_num; f++) {
+        free(plan->files[f].path);
+        frame_index_free(&plan->files[f].frame_index);
+    }
+    free(plan->files);
+    free(plan->pieces);
+    free(plan->piece_bounds);
+    memset(plan, 0, sizeof(*plan));
+}
+
+/* @ret: The weight of a piece in plan->total_bytes: its size, decompressed where the frame index records it */
+long split_piece_weight(SPLIT_PLAN * plan, SPLIT_PIECE * piece)
+{
+    INPUT_FILE * file = &plan->files[piece->file];
+    if (file->format == INPUT_PLAIN) {
+        return piece->end - piece->start;
+    }
+
+    long weight = 0;
+    for (off_t j = piece->start; j < piece->end; j++) {
+        weight += frame_weight(&file->frame_index.frames[j]);
+    }
+    return weight;
+}
+
+/* Open a piece for the map function.
+   @param plan: The split plan.
+   @param piece: The piece to open.
+   @param p_size: Receives the number of bytes the map function should read.
+   @ret: A file descriptor positioned at the start of the piece, or -1 on error.
+         A compressed piece is decompressed into an anonymous memory file first.
+ */
+int split_piece_open(SPLIT_PLAN * plan, SPLIT_PIECE * piece, long * p_size)
+{
+    INPUT_FILE * file = &plan->files[piece->file];
+    int fd = open(file->path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (file->format == INPUT_PLAIN) {
+        lseek(fd, piece->start, SEEK_SET);
+        *p_size = piece->end - piece->start;
+        return fd;
+    }
+
+    int mem_fd = memfd_create("mr-split", 0);
+    if (mem_fd < 0) {
+        close(fd);
+        return -1;
+    }
+    long raw_size = frame_extract_split(fd, &file->frame_index, piece->start, piece->end, mem_fd);
+    close(fd);
+    if (raw_size < 0) {
+        close(mem_fd);
+        return -1;
+    }
+    lseek(mem_fd, 0, SEEK_SET);
+    *p_size = raw_size;
+    return mem_fd;
+}
@@ -0,0 +1,52 @@
+/* The split plan of a job.
+   The input of a job may be several files, directories and glob patterns. The plan lays all
+   input files end to end and cuts them into splits of about the same number of bytes: small
+   files are packed together, and large files are cut at line boundaries (plain text) or frame
+   boundaries (compressed input). A split is therefore a list of pieces, each a part of one file. */
+
+#ifndef _SPLIT_PLAN_H
+#define _SPLIT_PLAN_H
+
+#include <time.h>
+#include <sys/types.h>
+#include "frame_index.h"
+
+#define SPLIT_PIECE_MAX (1L << 30) /* Longer pieces are cut, since DATA_SPLIT.size is an int */
+
+/* One input file */
+typedef struct _input_file
+{
+    char * path; /* The path of the file */
+    off_t size; /* The size of the file on disk */
+    dev_t dev; /* With ino and mtime, identifies this version of the file */
+    ino_t ino;
+    struct timespec mtime;
+    int format; /* One of the INPUT_* formats */
+    FRAME_INDEX frame_index; /* The frames of a compressed file */
+}INPUT_FILE;
+
+/* A part of one input file, processed by one call of the map function */
+typedef struct _split_piece
+{
+    int file; /* The index of the file in the plan */
+    off_t start; /* Plain input: the byte offset of the piece. Compressed input: its first frame */
+    off_t end; /* Plain input: one past its last byte. Compressed input: one past its last frame */
+}SPLIT_PIECE;
+
+typedef struct _split_plan
+{
+    int file_num; /* The number of input files */
+    INPUT_FILE * files; /* The input files, in the order they were named */
+    int split_num; /* The number of splits */
+    int piece_num; /* The number of pieces over all splits */
+    SPLIT_PIECE * pieces; /* The pieces, split after split */
+    int * piece_bounds; /* split_num + 1 entries; split i owns pieces [piece_bounds[i], piece_bounds[i + 1]) */
+    long total_bytes; /* The size of the input: decompressed where the frame index records it */
+}SPLIT_PLAN;
+
+int split_plan_build(const char * input, int split_num, long chunk_size, SPLIT_PLAN * plan);
+void split_plan_free(SPLIT_PLAN * plan);
+int split_piece_open(SPLIT_PLAN * plan, SPLIT_PIECE * piece, long * p_size);
+long split_piece_weight(SPLIT_PLAN * plan, SPLIT_PIECE * piece);
+
+#endif
@@ -6,6 +6,7 @@
 #include <ctype.h>
 #include "common.h"
 #include "usr_functions.h"
+#include "line_index.h"
 
 
 /* User-defined map function for the "Letter counter" task.  
@@ -108,6 +109,22 @@ int letter_counter_reduce(int * p_fd_in, int fd_in_num, int fd_out) {
     return 0; 
 }
 
+/* Whether a line holds target_word as a whole word, that is, not inside a longer alphanumeric run */
+static int line_has_word(const char * line, const char * target_word, size_t target_len)
+{
+    const char *match = strstr(line, target_word);
+
+    while (match) {
+        if ((match == line || !isalnum(*(match - 1))) &&
+            (!isalnum(*(match + target_len)))) {
+            return 1;
+        }
+        match = strstr(match + target_len, target_word);
+    }
+
+    return 0;
+}
+
 /* User-defined map function for the "Word finder" task.  
    This map function is called in a map worker process.
    @param split: The data split that the map function is going to work on.
@@ -161,19 +178,7 @@ int word_finder_map(DATA_SPLIT * split, int fd_out)
 
             line = start;
 
-            char *match = strstr(line, target_word);
-            int found = 0;
-
-            while (match) {
-                if ((match == line || !isalnum(*(match - 1))) &&       
-                    (!isalnum(*(match + target_len)))) {              
-                    found = 1;
-                    break;
-                }
-                match = strstr(match + target_len, target_word);      
-            }
-
-            if (found) {
+            if (line_has_word(line, target_word, target_len)) {
                 if (dprintf(fd_out, "%s\n", line) < 0) {
                     perror("Failed to write to intermediate file");
                     free(buffer);
@@ -237,4 +242,226 @@ int word_finder_reduce(int * p_fd_in, int fd_in_num, int fd_out)
     return 0;
 }
 
+/* User-defined map function for the "Line indexer" task.
+   This map function is called in a map worker process. It records, for every word (a maximal run of
+   alphanumeric characters, up to a NUL in the line like "Word finder"), the offsets of the lines of
+   the split that contain it. The offsets are file offsets, so split->fd must be the input file itself.
+   @param split: The data split that the map function is going to work on.
+   @param fd_out: The file descriptor of the itermediate data file output by the map function.
+   @ret: 0 on success, -1 on error.
+ */
+int line_indexer_map(DATA_SPLIT * split, int fd_out)
+{
+    if (!split || split->fd < 0 || fd_out < 0) {
+        return -1;
+    }
+
+    off_t base = lseek(split->fd, 0, SEEK_CUR);
+    if (base < 0) {
+        perror("Failed to locate the data split");
+        return -1;
+    }
+
+    char *buffer = malloc(split->size + 1);
+    if (!buffer) {
+        perror("Failed to allocate memory for the buffer");
+        return -1;
+    }
+
+    ssize_t bytes_read = 0;
+    while (bytes_read < split->size) {
+        ssize_t n = read(split->fd, buffer + bytes_read, split->size - bytes_read);
+        if (n < 0) {
+            perror("Failed to read from input file");
+            free(buffer);
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        bytes_read += n;
+    }
+
+    LINE_INDEX_BUILDER builder;
+    if (line_index_builder_init(&builder) < 0 || line_index_builder_identify(&builder, split->fd) < 0) {
+        line_index_builder_free(&builder);
+        free(buffer);
+        return -1;
+    }
+
+    int ret = 0;
+    ssize_t start = 0;
+    while (start < bytes_read && ret == 0) {
+        char *nl = memchr(buffer + start, '\n', bytes_read - start);
+        ssize_t end = nl ? nl - buffer : bytes_read;
+
+        ssize_t i = start;
+        while (i < end && buffer[i] != '\0' && ret == 0) {
+            if (!isalnum((unsigned char)buffer[i])) {
+                i++;
+                continue;
+            }
+            ssize_t word = i;
+            while (i < end && isalnum((unsigned char)buffer[i])) {
+                i++;
+            }
+            ret = line_index_builder_add(&builder, buffer + word, i - word, base + start);
+        }
+
+        start = end + 1;
+    }
+
+    if (ret == 0) {
+        ret = line_index_builder_write_text(&builder, fd_out);
+        if (ret < 0) {
+            perror("Failed to write to intermediate file");
+        }
+    }
+
+    line_index_builder_free(&builder);
+    free(buffer);
+    return ret;
+}
+
+/* User-defined reduce function for the "Line indexer" task.
+   This reduce function is called in a reduce worker process. It merges the postings of all splits
+   and writes the index file (see line_index.h) as the final result.
+   @param p_fd_in: The address of the buffer holding the intermediate data files' file descriptors.
+   @param fd_in_num: The number of the intermediate files.
+   @param fd_out: The file descriptor of the final result file.
+   @ret: 0 on success, -1 on error.
+ */
+int line_indexer_reduce(int * p_fd_in, int fd_in_num, int fd_out)
+{
+    if (!p_fd_in || fd_in_num <= 0 || fd_out < 0) {
+        fprintf(stderr, "Invalid arguments passed to reduce function.\n");
+        return -1;
+    }
+
+    LINE_INDEX_BUILDER builder;
+    if (line_index_builder_init(&builder) < 0) {
+        return -1;
+    }
+
+    int ret = 0;
+    /* Intermediate files are in split order, so every term's offsets arrive in increasing order */
+    for (int i = 0; i < fd_in_num; i++) {
+        if (ret == 0) {
+            ret = line_index_builder_read_text(&builder, p_fd_in[i]);
+        } else {
+            close(p_fd_in[i]);
+        }
+    }
 
+    if (ret == 0 && line_index_builder_write_index(&builder, fd_out) < 0) {
+        perror("Failed to write to result file");
+        ret = -1;
+    }
+
+    line_index_builder_free(&builder);
+    return ret;
+}
+
+/* User-defined map function for the "Match counter" task, a count-only "Word finder".
+   This map function is called in a map worker process. It counts the lines of the split that
+   hold the word, and outputs "matches <count>", so that a sampled run can estimate the total.
+   @param split: The data split that the map function is going to work on.
+   @param fd_out: The file descriptor of the itermediate data file output by the map function.
+   @ret: 0 on success, -1 on error.
+ */
+int match_counter_map(DATA_SPLIT * split, int fd_out)
+{
+    if (!split || split->fd < 0 || !split->usr_data || fd_out < 0) {
+        fprintf(stderr, "Invalid data split\n");
+        return -1;
+    }
+
+    const char *target_word = (const char *)split->usr_data;
+    size_t target_len = strlen(target_word);
+
+    if (target_len == 0) {
+        fprintf(stderr, "Target word is empty\n");
+        return -1;
+    }
+
+    char *buffer = malloc(split->size + 1);
+    if (!buffer) {
+        perror("Failed to allocate memory for the buffer");
+        return -1;
+    }
+
+    ssize_t bytes_read = 0;
+    while (bytes_read < split->size) {
+        ssize_t n = read(split->fd, buffer + bytes_read, split->size - bytes_read);
+        if (n < 0) {
+            perror("Failed to read from input file");
+            free(buffer);
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        bytes_read += n;
+    }
+    buffer[bytes_read] = '\0';
+
+    /* Lines are cut as word_finder_map cuts them */
+    long count = 0;
+    char *start = buffer;
+    while (start < buffer + bytes_read) {
+        char *nl = memchr(start, '\n', buffer + bytes_read - start);
+        if (nl) {
+            *nl = '\0';
+        }
+        count += line_has_word(start, target_word, target_len);
+        start = nl ? nl + 1 : buffer + bytes_read;
+    }
+
+    free(buffer);
+
+    if (dprintf(fd_out, "matches %ld\n", count) < 0) {
+        perror("Failed to write to intermediate file");
+        return -1;
+    }
+    return 0;
+}
+
+/* User-defined reduce function for the "Match counter" task.
+   This reduce function is called in a reduce worker process. It sums the counts of all splits.
+   @param p_fd_in: The address of the buffer holding the intermediate data files' file descriptors.
+   @param fd_in_num: The number of the intermediate files.
+   @param fd_out: The file descriptor of the final result file.
+   @ret: 0 on success, -1 on error.
+ */
+int match_counter_reduce(int * p_fd_in, int fd_in_num, int fd_out)
+{
+    if (!p_fd_in || fd_in_num <= 0 || fd_out < 0) {
+        fprintf(stderr, "Invalid arguments passed to reduce function.\n");
+        return -1;
+    }
+
+    long total = 0;
+    for (int i = 0; i < fd_in_num; i++) {
+        FILE *file = fdopen(p_fd_in[i], "r");
+        if (!file) {
+            perror("Failed to open intermediate file");
+            return -1;
+        }
+
+        char line[128];
+        long count;
+        while (fgets(line, sizeof(line), file)) {
+            if (sscanf(line, "matches %ld", &count) == 1) {
+                total += count;
+            }
+        }
+
+        fclose(file);
+    }
+
+    if (dprintf(fd_out, "matches %ld\n", total) < 0) {
+        perror("Failed to write to result file");
+        return -1;
+    }
+    return 0;
+}
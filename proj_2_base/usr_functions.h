@@ -1,4 +1,4 @@
-/* You don't need to change this file */
+/* The map and reduce functions of the letter counter, word finder, match counter and line indexer */
 
 #ifndef _USR_FUNCTIONS_H
 #define _USR_FUNCTIONS_H
@@ -12,5 +12,11 @@ int letter_counter_reduce(int * p_fd_in, int fd_in_num, int fd_out);
 int word_finder_map(DATA_SPLIT * split, int fd_out);
 int word_finder_reduce(int * p_fd_in, int fd_in_num, int fd_out);
 
+int line_indexer_map(DATA_SPLIT * split, int fd_out);
+int line_indexer_reduce(int * p_fd_in, int fd_in_num, int fd_out);
+
+int match_counter_map(DATA_SPLIT * split, int fd_out);
+int match_counter_reduce(int * p_fd_in, int fd_in_num, int fd_out);
+
 
 #endif